@@ -28,7 +28,8 @@ static const char *const instruction_names[] = {
     "any", "char", "set", "span", "ret", "end", "choice", "jmp", "call",
     "open_call", "commit", "partial_commit", "back_commit", "failtwice",
     "fail", "giveup", "func", "fullcapture", "emptycapture",
-    "emptycaptureidx", "opencapture", "closecapture", "closeruntime"
+    "emptycaptureidx", "opencapture", "closecapture", "closeruntime",
+    "dispatch", "trie"
 };
 
 #define INAME(i) (instruction_names[i])
@@ -54,6 +55,7 @@ static const Instruction Dummy[] =
 /* Forward declaration of the Pattern and Match types */
 static PyTypeObject PatternType;
 static PyTypeObject MatchType;
+static PyTypeObject NodeType;
 #define pattern_cls ((PyObject *)(&PatternType))
 #define match_cls ((PyObject *)(&MatchType))
 
@@ -67,24 +69,90 @@ typedef struct {
      * here
      */
     PyObject *env;
+    /* Summary of the program, computed on first use (see pattflags) */
+    int flags;
+    /* Canonical ids of group names, computed on first use (see
+     * pattgroupids)
+     */
+    int *groupids;
+    Py_ssize_t ngroupids;
+    /* Number of arguments taken by each function capture's function,
+     * computed on first use (see pattarities)
+     */
+    int *arities;
+    Py_ssize_t narities;
+    /* Automaton finding where the strings the pattern starts with occur,
+     * built on first search (see pattsearcher)
+     */
+    struct Searcher *searcher;
+    /* A pattern built by + or | defers its code until it is first needed,
+     * so that long chains are built in linear time (see pattcompile).
+     * Until then, prog is NULL and pending says which operator applies to
+     * the operands left and right.
+     */
+    int pending;
+    PyObject *left;
+    PyObject *right;
 #ifdef TRACE
     PyObject *trace;
 #endif
 } Pattern;
 
+/* Pending operators */
+#define PEND_NONE   0
+#define PEND_CONCAT 1
+#define PEND_CHOICE 2
+
+/* Pattern flags */
+#define PF_ANALYSED 1   /* flags are valid for the current program */
+#define PF_RUNTIME  2   /* program contains match-time captures */
+#define PF_BACKREF  4   /* program contains back references */
+
+/* A capture in a parse tree (see Pattern_parse). The children of a node
+ * follow it directly, and end at index after, which is also the index of
+ * the node's next sibling.
+ */
+typedef struct {
+    Py_ssize_t start;
+    Py_ssize_t end;
+    Py_ssize_t after;
+    short idx;
+    byte kind;
+} TreeNode;
+
 typedef struct {
     PyObject_HEAD
     /* Type-specific fields go here. */
     long pos;
+    /* Start of the match, which is 0 unless it was found by search() */
+    long start;
     PyObject *captures;
+    /* Parse tree, for matches returned by parse() */
+    TreeNode *tree;
+    Py_ssize_t treelen;
+    PyObject *subject;
+    PyObject *patt;
 } Match;
 
+typedef struct {
+    PyObject_HEAD
+    Match *owner;
+    Py_ssize_t index;
+} Node;
+
 /* Accessors - object must be of the correct type!
  * These are lvalues, and can be used as the target of an assignment.
  */
 #define patprog(pat) (((Pattern *)(pat))->prog)
 #define patlen(pat) (((Pattern *)(pat))->prog_len)
 #define patenv(pat) (((Pattern *)(pat))->env)
+#define patflags(pat) (((Pattern *)(pat))->flags)
+#define patgroupids(pat) (((Pattern *)(pat))->groupids)
+#define patarities(pat) (((Pattern *)(pat))->arities)
+#define patsearcher(pat) (((Pattern *)(pat))->searcher)
+#define patpending(pat) (((Pattern *)(pat))->pending)
+
+static int pattcompile(PyObject *patt);
 #define patsize(pat) ((patlen(pat)) - 1)
 
 /* **********************************************************************
@@ -106,9 +174,19 @@ static int resize_patt(PyObject *patt, Py_ssize_t n) {
         return -1;
     }
 
-    memset(p, 0, (sizeof(Instruction) * n+1));
+    memset(p, 0, sizeof(Instruction) * (n + 1));
     setinst(p + n, IEnd, 0);
     patlen(patt) = n + 1;
+    patflags(patt) = 0;
+    PyMem_Del(patgroupids(patt));
+    patgroupids(patt) = NULL;
+    PyMem_Del(patarities(patt));
+    patarities(patt) = NULL;
+    PyMem_Del(patsearcher(patt));
+    patsearcher(patt) = NULL;
+    patpending(patt) = PEND_NONE;
+    Py_CLEAR(((Pattern *)patt)->left);
+    Py_CLEAR(((Pattern *)patt)->right);
     return 0;
 }
 
@@ -190,7 +268,10 @@ int ensure_patterns(PyObject **self, PyObject **other) {
     return 0;
 }
 
-/* Merge the environments of 2 patterns */
+/* Merge the environments of 2 patterns. The environment of p1 is extended
+ * in place, so it is never shared with p2. Environment indexes have to fit
+ * in an instruction offset.
+ */
 Py_ssize_t mergeenv (PyObject *p1, PyObject *p2) {
     PyObject *e1 = patenv(p1);
     PyObject *e2 = patenv(p2);
@@ -200,13 +281,19 @@ Py_ssize_t mergeenv (PyObject *p1, PyObject *p2) {
         /* No correction needed */
         n = 0;
         if (e2 != NULL) {
-            Py_INCREF(e2);
-            patenv(p1) = e2;
+            patenv(p1) = PyList_GetSlice(e2, 0, PyList_GET_SIZE(e2));
+            if (patenv(p1) == NULL)
+                return -1;
         }
     } else {
         n = PyList_Size(e1);
         if (e2 != NULL) {
-            PyObject *new = PySequence_InPlaceConcat(e1, e2);
+            PyObject *new;
+            if (n + PyList_GET_SIZE(e2) > SHRT_MAX) {
+                PyErr_SetString(PyExc_ValueError, "Pattern too big");
+                return -1;
+            }
+            new = PySequence_InPlaceConcat(e1, e2);
             if (new == NULL)
                 return -1;
             Py_XDECREF(new);
@@ -248,12 +335,21 @@ Py_ssize_t addpatt (PyObject *self, Instruction *p, PyObject *other)
 /* Pattern */
 static void Pattern_dealloc(Pattern* self)
 {
+    /* Chains of deferred patterns can be very deep */
+    PyObject_GC_UnTrack(self);
+    Py_TRASHCAN_SAFE_BEGIN(self)
     PyMem_Del(self->prog);
+    PyMem_Del(self->groupids);
+    PyMem_Del(self->arities);
+    PyMem_Del(self->searcher);
     Py_XDECREF(self->env);
+    Py_XDECREF(self->left);
+    Py_XDECREF(self->right);
 #ifdef TRACE
     Py_XDECREF(self->trace);
 #endif
     self->ob_type->tp_free((PyObject*)self);
+    Py_TRASHCAN_SAFE_END(self)
 }
 
 static PyObject *Pattern_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
@@ -262,6 +358,13 @@ static PyObject *Pattern_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     if (self) {
         patprog(self) = NULL;
         patenv(self) = NULL;
+        patflags(self) = 0;
+        patgroupids(self) = NULL;
+        patarities(self) = NULL;
+        patsearcher(self) = NULL;
+        patpending(self) = PEND_NONE;
+        ((Pattern*)self)->left = NULL;
+        ((Pattern*)self)->right = NULL;
 #ifdef TRACE
         ((Pattern*)self)->trace = NULL;
 #endif
@@ -271,6 +374,8 @@ static PyObject *Pattern_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 
 static int Pattern_traverse(Pattern *self, visitproc visit, void *arg) {
     Py_VISIT(self->env);
+    Py_VISIT(self->left);
+    Py_VISIT(self->right);
 #ifdef TRACE
     Py_VISIT(self->trace);
 #endif
@@ -279,6 +384,8 @@ static int Pattern_traverse(Pattern *self, visitproc visit, void *arg) {
 
 static int Pattern_clear(Pattern *self) {
     Py_CLEAR(self->env);
+    Py_CLEAR(self->left);
+    Py_CLEAR(self->right);
 #ifdef TRACE
     Py_CLEAR(self->trace);
 #endif
@@ -286,29 +393,78 @@ static int Pattern_clear(Pattern *self) {
 }
 
 /* Match */
+
+/* Deallocated Match objects (of the exact type) are kept on a freelist,
+ * linked through their captures field, and reused by new_match.
+ */
+#define MATCH_MAXFREELIST 80
+static Match *match_freelist = NULL;
+static int match_numfree = 0;
+
 static void Match_dealloc(Match* self)
 {
+    PyObject_GC_UnTrack(self);
     Py_XDECREF(self->captures);
+    Py_XDECREF(self->subject);
+    Py_XDECREF(self->patt);
+    PyMem_Del(self->tree);
+    if (Py_TYPE(self) == &MatchType && match_numfree < MATCH_MAXFREELIST) {
+        self->captures = (PyObject *)match_freelist;
+        match_freelist = self;
+        match_numfree++;
+        return;
+    }
     self->ob_type->tp_free((PyObject*)self);
 }
 
+/* Create a Match, without going through the type's tp_new */
+static Match *new_match(void)
+{
+    Match *self = match_freelist;
+    if (self) {
+        match_freelist = (Match *)self->captures;
+        match_numfree--;
+        _Py_NewReference((PyObject *)self);
+    }
+    else {
+        self = PyObject_GC_New(Match, &MatchType);
+        if (self == NULL)
+            return NULL;
+    }
+    self->pos = -1;
+    self->start = 0;
+    self->captures = NULL;
+    self->tree = NULL;
+    self->treelen = 0;
+    self->subject = NULL;
+    self->patt = NULL;
+    PyObject_GC_Track(self);
+    return self;
+}
+
 static PyObject *Match_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *self = type->tp_alloc(type, 0);
     if (self) {
         ((Match*)self)->pos = -1;
         ((Match*)self)->captures = NULL;
+        ((Match*)self)->tree = NULL;
+        ((Match*)self)->treelen = 0;
+        ((Match*)self)->subject = NULL;
+        ((Match*)self)->patt = NULL;
     }
     return self;
 }
 
 static int Match_traverse(Match *self, visitproc visit, void *arg) {
     Py_VISIT(self->captures);
+    Py_VISIT(self->patt);
     return 0;
 }
 
 static int Match_clear(Match *self) {
     Py_CLEAR(self->captures);
+    Py_CLEAR(self->patt);
     return 0;
 }
 
@@ -436,6 +592,49 @@ static int init_callable(PyObject *self, PyObject *callable) {
     setinstcap(p + 1, ICloseRunTime, 0, Cclose, 0);
     return 0;
 }
+/* Native matching functions are passed to Pattern() as a capsule named
+ * PATTFUNC_CAPSULE, holding a pointer to a PattFuncDef. The function is
+ * called as f(ud, o, s, e), with the subject from o to e and the current
+ * position s, and returns the new position (from s to e) or NULL to fail.
+ * The udlen bytes at ud are copied into the pattern, so ud only needs to
+ * live as long as the Pattern() call, and the function sees the copy.
+ * The function is called with the GIL held, and must not use the Python
+ * API.
+ */
+#define PATTFUNC_CAPSULE "_ppeg.PattFunc"
+
+typedef struct PattFuncDef {
+    PattFunc f;
+    const void *ud;
+    size_t udlen;
+} PattFuncDef;
+
+static int init_func(PyObject *self, PyObject *capsule) {
+    PattFuncDef *def = PyCapsule_GetPointer(capsule, PATTFUNC_CAPSULE);
+    Py_ssize_t n;
+    Instruction *p;
+    if (def == NULL)
+        return -1;
+    if (def->f == NULL || (def->udlen && def->ud == NULL)) {
+        PyErr_SetString(PyExc_ValueError, "Invalid native function definition");
+        return -1;
+    }
+    if (def->udlen >= MAXPATTSIZE * sizeof(Instruction)) {
+        PyErr_SetString(PyExc_ValueError, "Pattern too big");
+        return -1;
+    }
+    /* Opcode, function, then the user data */
+    n = instsize(def->udlen ? def->udlen : 1) + 1;
+    if (resize_patt(self, n) == -1)
+        return -1;
+    p = patprog(self);
+    setinst(p, IFunc, n);
+    p[1].f = def->f;
+    if (def->udlen)
+        memcpy(p[2].buff, def->ud, def->udlen);
+    return 0;
+}
+
 static int Pattern_init(PyObject *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"match", "set", "range", NULL};
@@ -494,6 +693,9 @@ static int Pattern_init(PyObject *self, PyObject *args, PyObject *kwds)
             goto invalid;
         return init_match(self, str, len);
     }
+    else if (PyCapsule_CheckExact(match)) {
+        return init_func(self, match);
+    }
     else if (PyCallable_Check(match)) {
         return init_callable(self, match);
     }
@@ -501,7 +703,8 @@ static int Pattern_init(PyObject *self, PyObject *args, PyObject *kwds)
 invalid:
         PyErr_Format(PyExc_TypeError,
                      "Pattern() argument must be either None, a number, "
-                     "a string, or a callable; not '%.200s'",
+                     "a string, a callable, or a native function capsule; "
+                     "not '%.200s'",
                      Py_TYPE(match)->tp_name);
         return -1;
     }
@@ -555,183 +758,268 @@ static PyObject *env2val(PyObject *patt, Py_ssize_t idx) {
     return result;
 }
 
+/* The label of a capture - its environment value, the argument number for
+ * an argument capture, or None.
+ */
+static PyObject *caplabel(PyObject *patt, int kind, int idx) {
+    if (kind == Carg)
+        return PyInt_FromLong(idx);
+    if (idx == 0)
+        Py_RETURN_NONE;
+    return env2val(patt, idx);
+}
+
 /* **********************************************************************
  * Pattern verifier
  * **********************************************************************
  */
-static Py_ssize_t getposition(PyObject *patt, PyObject *positions, int i)
-{
-    PyObject *key = env2val(patt, i);
-    PyObject *val;
-    if (key == NULL)
-        return -1;
-    val = PyDict_GetItem(positions, key);
-    if (val == NULL)
-        return -1;
-    return PyInt_AsSsize_t(val);
-}
-
 /* TODO: Fix this up */
 void set_error_id(PyObject *exc, const char *format, PyObject *id) {
     PyObject *str = NULL;
     char *s = "<invalid>";
     if (id) {
         str = PyObject_Str(id);
-        s = PyString_AS_STRING(str);
-        Py_DECREF(str);
+        if (str)
+            s = PyString_AS_STRING(str);
     }
     PyErr_Format(exc, format, s);
+    Py_XDECREF(str);
 }
 
-/* Return: -1=error, 0=possible infinite loop, 1=valid */
-static int verify (PyObject *patt, Instruction *op, const Instruction *p,
-                   Instruction *e, PyObject *positions, PyObject *id) {
+/* The verifier looks for paths through a program which consume no input.
+ * Along such a path every check instruction fails and every test jumps.
+ * ret[i] is set if an IRet can be reached from i along such a path, so for
+ * the start of a rule it says whether the rule can match the empty string.
+ * It is found by working back from the IRets. A call only links to the
+ * instruction after it once the callee is known to return, so the analysis
+ * is linear in the size of the program, however the rules call each other.
+ */
+typedef struct NullEdge {
+    int from;
+    int cond;           /* callee the edge depends on, or -1 */
+    int next;
+} NullEdge;
+
+typedef struct Verifier {
+    const Instruction *op;
+    int size;
+    const int *positions;   /* rule positions, in a grammar being built */
+    byte *ret;
+    int *stamp;             /* marks for forward scans */
+    int gen;
+    int *work;
+} Verifier;
+
+/* The instructions which can follow i on a path consuming no input. A call
+ * is followed by the next instruction only if the callee can return. Open
+ * calls outside a grammar fail, to be verified later. Loops are checked
+ * separately, so a loop is left as if its body had been matched once.
+ */
+static int nullsucc(const Verifier *v, int i, int *next) {
     static const char dummy[] = "";
-    Stack back[MAXBACK];
-    int backtop = 0;  /* point to first empty slot in back */
-    while (p != e) {
-        switch ((Opcode)p->i.code) {
-            case IRet: {
-                p = back[--backtop].p;
-                continue;
-            }
-            case IChoice: {
-                if (backtop >= MAXBACK) {
-                    PyErr_SetString(PyExc_RuntimeError, "Too many pending calls/choices");
-                    return -1;
-                }
-                back[backtop].p = dest(0, p);
-                back[backtop++].s = dummy;
-                p++;
-                continue;
-            }
-            case ICall: {
-                assert((p + 1)->i.code != IRet);  /* no tail call */
-                if (backtop >= MAXBACK) {
-                    PyErr_SetString(PyExc_RuntimeError, "Too many pending calls/choices");
-                    return -1;
-                }
-                back[backtop].s = NULL;
-                back[backtop++].p = p + 1;
-                goto dojmp;
-            }
-            case IOpenCall: {
-                int i;
-                if (positions == NULL)  /* grammar still not fixed? */
-                    goto fail;  /* to be verified later */
-                for (i = 0; i < backtop; i++) {
-                    if (back[i].s == NULL && back[i].p == p + 1) {
-                        set_error_id(PyExc_RuntimeError, "Rule %s is left recursive", id);
-                        return -1;
-                    }
-                }
-                if (backtop >= MAXBACK) {
-                    PyErr_SetString(PyExc_RuntimeError, "Too many pending calls/choices");
-                    return -1;
-                }
-                back[backtop].s = NULL;
-                back[backtop++].p = p + 1;
-                p = op + getposition(patt, positions, p->i.offset);
-                continue;
-            }
-            case IBackCommit:
-            case ICommit: {
-                assert(backtop > 0 && p->i.offset > 0);
-                backtop--;
-                goto dojmp;
-            }
-            case IPartialCommit: {
-                assert(backtop > 0);
-                if (p->i.offset > 0) goto dojmp;  /* forward jump */
-                else {  /* loop will be detected when checking corresponding rule */
-                    assert(positions != NULL);
-                    backtop--;
-                    p++;  /* just go on now */
-                    continue;
-                }
-            }
-            case IAny:
-            case IChar:
-            case ISet: {
-                if (p->i.offset == 0) goto fail;
-                /* else goto dojmp; go through */
-            }
-            case IJmp: 
-            dojmp: {
-                p += p->i.offset;
-                continue;
-            }
-            case IFailTwice:  /* 'not' predicate */
-                goto fail;  /* body could have failed; try to backtrack it */
-            case IFail: {
-                if (p > op && (p - 1)->i.code == IBackCommit) {  /* 'and' predicate? */
-                    p++;  /* pretend it succeeded and go ahead */
-                    continue;
-                }
-                /* else failed: go through */
-            }
-            fail: { /* pattern failed: try to backtrack */
-                do {
-                    if (backtop-- == 0)
-                        return 1;  /* no more backtracking */
-                } while (back[backtop].s == NULL);
-                p = back[backtop].p;
-                continue;
+    const Instruction *p = v->op + i;
+    switch ((Opcode)p->i.code) {
+        case IChoice:
+            next[0] = i + 1;
+            next[1] = dest(v->op, i);
+            return 2;
+        case ICall:
+            if (!v->ret[dest(v->op, i)])
+                return 0;
+            next[0] = i + 1;
+            return 1;
+        case IOpenCall:
+            if (v->positions == NULL || !v->ret[v->positions[p->i.offset]])
+                return 0;
+            next[0] = i + 1;
+            return 1;
+        case IPartialCommit:
+            if (p->i.offset < 0) {
+                next[0] = i + 1;
+                return 1;
             }
-            case ISpan:
-            case IOpenCapture: case ICloseCapture:
-            case IEmptyCapture: case IEmptyCaptureIdx:
-            case IFullCapture: {
-                p += sizei(p);
-                continue;
+            /* Fall through */
+        case IJmp: case ICommit: case IBackCommit:
+            next[0] = dest(v->op, i);
+            return 1;
+        case IAny: case IChar: case ISet:
+            if (p->i.offset == 0)
+                return 0;
+            next[0] = dest(v->op, i);
+            return 1;
+        case IFail:
+            if (i > 0 && (p - 1)->i.code == IBackCommit) {  /* 'and' predicate? */
+                next[0] = i + 1;  /* pretend it succeeded and go ahead */
+                return 1;
             }
-            case ICloseRunTime: {
-                goto fail;  /* be liberal in this case */
+            return 0;
+        case ISpan: case IDispatch:  /* the tests after a dispatch recheck */
+        case IOpenCapture: case ICloseCapture:
+        case IEmptyCapture: case IEmptyCaptureIdx:
+        case IFullCapture:
+            next[0] = i + sizei(p);
+            return 1;
+        case IFunc:
+            if ((p+1)->f((p+2)->buff, dummy, dummy, dummy) == NULL)
+                return 0;
+            next[0] = i + p->i.offset;
+            return 1;
+        default:  /* IRet, IEnd, IFailTwice, IGiveup, ICloseRunTime, ITrie */
+            return 0;
+    }
+}
+
+/* The callee of a call instruction, or -1 */
+static int nullcallee(const Verifier *v, int i) {
+    const Instruction *p = v->op + i;
+    if (p->i.code == ICall)
+        return dest(v->op, i);
+    if (p->i.code == IOpenCall && v->positions)
+        return v->positions[p->i.offset];
+    return -1;
+}
+
+static void free_verifier(Verifier *v) {
+    PyMem_Del(v->ret);
+    PyMem_Del(v->stamp);
+    PyMem_Del(v->work);
+}
+
+/* Set up a verifier for the size instructions at op, and work out ret */
+static int init_verifier(Verifier *v, const Instruction *op, int size,
+                         const int *positions) {
+    NullEdge *edges = NULL;
+    int *head = NULL;
+    int *waiting;
+    int i, n, top = 0, nedges = 0, hasret = 0;
+
+    v->op = op;
+    v->size = size;
+    v->positions = positions;
+    v->gen = 0;
+    v->ret = PyMem_New(byte, size + 1);
+    v->stamp = PyMem_New(int, size + 1);
+    v->work = PyMem_New(int, size + 1);
+    if (v->ret == NULL || v->stamp == NULL || v->work == NULL)
+        goto nomem;
+    memset(v->ret, 0, size + 1);
+    memset(v->stamp, 0, (size + 1) * sizeof(int));
+    for (i = 0; i < size; i += sizei(op + i))
+        if (op[i].i.code == IRet)
+            hasret = 1;
+    if (!hasret)
+        return 0;  /* nothing can return */
+
+    /* Edges back from each instruction to the ones that can precede it. A
+     * call is linked to the instruction after it conditionally, and is also
+     * listed as waiting on its callee.
+     */
+    edges = PyMem_New(NullEdge, 3 * size + 1);
+    head = PyMem_New(int, 2 * (size + 1));
+    if (edges == NULL || head == NULL)
+        goto nomem;
+    waiting = head + size + 1;
+    for (i = 0; i < 2 * (size + 1); i++)
+        head[i] = -1;
+    for (i = 0; i < size; i += sizei(op + i)) {
+        int next[2];
+        int callee = nullcallee(v, i);
+        int k;
+        if (callee >= 0) {
+            edges[nedges].from = i;
+            edges[nedges].cond = callee;
+            edges[nedges].next = head[i + 1];
+            head[i + 1] = nedges++;
+            edges[nedges].from = i;
+            edges[nedges].cond = -1;
+            edges[nedges].next = waiting[callee];
+            waiting[callee] = nedges++;
+            continue;
+        }
+        n = nullsucc(v, i, next);
+        for (k = 0; k < n; k++) {
+            edges[nedges].from = i;
+            edges[nedges].cond = -1;
+            edges[nedges].next = head[next[k]];
+            head[next[k]] = nedges++;
+        }
+        if (op[i].i.code == IRet) {
+            v->ret[i] = 1;
+            v->work[top++] = i;
+        }
+    }
+
+    while (top > 0) {
+        int j = v->work[--top];
+        int e;
+        for (e = head[j]; e >= 0; e = edges[e].next) {
+            int from = edges[e].from;
+            if (!v->ret[from] && (edges[e].cond < 0 || v->ret[edges[e].cond])) {
+                v->ret[from] = 1;
+                v->work[top++] = from;
             }
-            case IFunc: {
-                const char *r = (p+1)->f((p+2)->buff, dummy, dummy, dummy);
-                if (r == NULL) goto fail;
-                p += p->i.offset;
-                continue;
+        }
+        for (e = waiting[j]; e >= 0; e = edges[e].next) {
+            int from = edges[e].from;
+            if (!v->ret[from] && v->ret[from + 1]) {
+                v->ret[from] = 1;
+                v->work[top++] = from;
             }
-            case IEnd:  /* cannot happen (should stop before it) */
-            default: assert(0); return 0;
         }
     }
-    assert(backtop == 0);
+    PyMem_Del(edges);
+    PyMem_Del(head);
     return 0;
+
+nomem:
+    PyMem_Del(edges);
+    PyMem_Del(head);
+    free_verifier(v);
+    PyErr_NoMemory();
+    return -1;
 }
 
-static int checkrule (PyObject *patt, int from, int to, PyObject *positions, PyObject *id) {
-    int i;
-    int lastopen = 0;  /* more recent OpenCall seen in the code */
-    Instruction *op = patprog(patt);
-    for (i = from; i < to; i += sizei(op + i)) {
-        if (op[i].i.code == IPartialCommit && op[i].i.offset < 0) {  /* loop? */
-            int start = dest(op, i);
-            assert(op[start - 1].i.code == IChoice && dest(op, start - 1) == i + 1);
-            if (start <= lastopen) {  /* loop does contain an open call? */
-                /* check body */
-                switch (verify(patt, op, op + start, op + i, positions, id)) {
-                    case 0:
-                        set_error_id(PyExc_RuntimeError, "Possible infinite loop in rule %s", id);
-                        /* Fall through */
-                    case -1:
-                        return -1;
-                    default: /* result is valid, so do nothing */
-                        break;
-                }
+/* Scan forward from from along paths consuming no input. Return 1 if to is
+ * reached. If calls is not NULL, the rules called along the way are added
+ * to it, and the whole scan is done.
+ */
+static int nullscan(Verifier *v, int from, int to, int *calls, int *ncalls) {
+    int top = 0;
+    int gen = ++v->gen;
+    v->stamp[from] = gen;
+    v->work[top++] = from;
+    while (top > 0) {
+        int i = v->work[--top];
+        int next[2];
+        int n, k;
+        if (i == to)
+            return 1;
+        if (calls && v->op[i].i.code == IOpenCall)
+            calls[(*ncalls)++] = v->op[i].i.offset;
+        n = nullsucc(v, i, next);
+        for (k = 0; k < n; k++) {
+            if (v->stamp[next[k]] != gen) {
+                v->stamp[next[k]] = gen;
+                v->work[top++] = next[k];
             }
         }
-        else if (op[i].i.code == IOpenCall)
-            lastopen = i;
     }
-    assert(op[i - 1].i.code == IRet);
-    if (verify(patt, op, op + from, op + to - 1, positions, id) == -1)
-        return -1;
     return 0;
 }
 
+/* Return 1 if the len instructions at op can match without consuming any
+ * input (reaching the end), 0 if not, and -1 on error.
+ */
+static int acceptsempty(const Instruction *op, int len) {
+    Verifier v;
+    int result;
+    if (init_verifier(&v, op, len, NULL) == -1)
+        return -1;
+    result = nullscan(&v, 0, len, NULL, NULL);
+    free_verifier(&v);
+    return result;
+}
+
 /* **********************************************************************
  * Constructors
  * **********************************************************************
@@ -861,6 +1149,7 @@ static int loop_args(PyObject *args, PyObject *kw, LoopFn handler, void *extra)
             Py_DECREF(key);
             return -1;
         }
+        Py_DECREF(key);
     }
 
     i = 0;
@@ -872,72 +1161,472 @@ static int loop_args(PyObject *args, PyObject *kw, LoopFn handler, void *extra)
     return 0;
 }
 
+/* Rules are numbered in the order they are given. The rule names are only
+ * looked up once, to number the open calls (see resolvecalls); after that,
+ * the grammar is built using the rule numbers.
+ */
 typedef struct RuleData {
     Py_ssize_t totalsize;
-    PyObject *ruleids;
-    PyObject *rules;
-    PyObject *positions;
+    int nrules;
+    int allocated;
+    PyObject *ids;          /* rule name -> rule number */
+    PyObject **names;       /* rule names, by number */
+    PyObject **rules;       /* rule patterns, by number */
+    int *positions;         /* position of each rule in the grammar */
 } RuleData;
 
 static int init_rule_data(RuleData *r, Py_ssize_t totalsize) {
+    memset(r, 0, sizeof(RuleData));
     r->totalsize = totalsize;
-    r->rules = PyList_New(0);
-    if (r->rules == NULL)
-        return -1;
-    r->ruleids = PyList_New(0);
-    if (r->ruleids == NULL) {
-        Py_DECREF(r->rules);
-        return -1;
-    }
-    r->positions = PyDict_New();
-    if (r->positions == NULL) {
-        Py_DECREF(r->rules);
-        Py_DECREF(r->ruleids);
+    r->ids = PyDict_New();
+    if (r->ids == NULL)
         return -1;
-    }
     return 0;
 }
 
 static void free_rule_data(RuleData *r) {
-    Py_XDECREF(r->rules);
-    Py_XDECREF(r->ruleids);
-    Py_XDECREF(r->positions);
+    int i;
+    for (i = 0; i < r->nrules; i++) {
+        Py_DECREF(r->names[i]);
+        Py_DECREF(r->rules[i]);
+    }
+    Py_XDECREF(r->ids);
+    PyMem_Del(r->names);
+    PyMem_Del(r->rules);
+    PyMem_Del(r->positions);
 }
 
 static int add_rule(PyObject *key, PyObject *val, void *extra) {
     RuleData *r = (RuleData *)extra;
-    PyObject *py_ts;
+    PyObject *id;
 
     if (!PyObject_IsInstance(val, pattern_cls)) {
         PyErr_SetString(PyExc_TypeError, "Grammar rule must be a pattern");
         return -1;
     }
-
-    py_ts = PyInt_FromSsize_t(r->totalsize);
-    if (py_ts == NULL)
-        return -1;
-    if (PyDict_SetItem(r->positions, key, py_ts)) {
-        Py_DECREF(py_ts);
+    if (pattcompile(val) == -1)
         return -1;
+
+    if (r->nrules == r->allocated) {
+        int n = r->allocated ? r->allocated * 2 : 16;
+        PyObject **names = PyMem_Resize(r->names, PyObject *, n);
+        PyObject **rules;
+        if (names == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        r->names = names;
+        rules = PyMem_Resize(r->rules, PyObject *, n);
+        if (rules == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        r->rules = rules;
+        r->allocated = n;
     }
-    Py_DECREF(py_ts);
-    if (PyList_Append(r->ruleids, key) == -1)
+
+    id = PyInt_FromLong(r->nrules);
+    if (id == NULL)
         return -1;
-    if (PyList_Append(r->rules, val) == -1)
+    if (PyDict_SetItem(r->ids, key, id) == -1) {
+        Py_DECREF(id);
         return -1;
+    }
+    Py_DECREF(id);
+    Py_INCREF(key);
+    r->names[r->nrules] = key;
+    Py_INCREF(val);
+    r->rules[r->nrules++] = val;
 
     /* Add space for pattern + RET */
     r->totalsize += patsize(val) + 1;
     return 0;
 }
 
+/* Replace the environment index of each open call in the grammar by the
+ * number of the rule it calls. Each name is looked up once.
+ */
+static int resolvecalls(PyObject *patt, RuleData *r) {
+    Instruction *p = patprog(patt);
+    PyObject *env = patenv(patt);
+    Py_ssize_t envlen = env ? PyList_GET_SIZE(env) : 0;
+    int *ids = PyMem_New(int, envlen + 1);
+    Py_ssize_t i;
+
+    if (ids == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i <= envlen; i++)
+        ids[i] = -1;
+    for (i = 0; i < r->totalsize; i += sizei(p + i)) {
+        int idx = p[i].i.offset;
+        if (p[i].i.code != IOpenCall)
+            continue;
+        if (idx < 1 || idx > envlen) {
+            PyMem_Del(ids);
+            PyErr_SetString(PyExc_IndexError, "Pattern env index out of range");
+            return -1;
+        }
+        if (ids[idx] == -1) {
+            PyObject *key = PyList_GET_ITEM(env, idx - 1);
+            PyObject *id = PyDict_GetItem(r->ids, key);
+            if (id == NULL) {
+                PyMem_Del(ids);
+                set_error_id(PyExc_RuntimeError, "rule '%s' is not defined", key);
+                return -1;
+            }
+            ids[idx] = PyInt_AS_LONG(id);
+        }
+        p[i].i.offset = ids[idx];
+    }
+    PyMem_Del(ids);
+    return 0;
+}
+
+/* Check the rules of a grammar: no rule may call itself, directly or
+ * through other rules, without consuming input first, and no loop whose
+ * body contains a call may match the empty string.
+ */
+static int checkgrammar(Instruction *op, RuleData *r) {
+    Verifier v;
+    int *calls = NULL, *first = NULL, *state = NULL, *frames, *framepos;
+    int i, k, ncalls = 0, fp = 0, ret = -1;
+
+    if (init_verifier(&v, op, (int)r->totalsize, r->positions) == -1)
+        return -1;
+    calls = PyMem_New(int, r->totalsize);
+    first = PyMem_New(int, r->nrules + 1);
+    state = PyMem_New(int, 3 * r->nrules);
+    if (calls == NULL || first == NULL || state == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* The rules each rule can call before consuming any input must not
+     * lead back to it.
+     */
+    for (i = 0; i < r->nrules; i++) {
+        first[i] = ncalls;
+        nullscan(&v, r->positions[i], -1, calls, &ncalls);
+    }
+    first[r->nrules] = ncalls;
+    memset(state, 0, r->nrules * sizeof(int));
+    frames = state + r->nrules;
+    framepos = frames + r->nrules;
+    for (i = 0; i < r->nrules; i++) {
+        if (state[i])
+            continue;
+        state[i] = 1;
+        frames[fp] = i;
+        framepos[fp++] = first[i];
+        while (fp > 0) {
+            int rule = frames[fp - 1];
+            int w;
+            if (framepos[fp - 1] == first[rule + 1]) {
+                state[rule] = 2;
+                fp--;
+                continue;
+            }
+            w = calls[framepos[fp - 1]++];
+            if (state[w] == 1) {
+                set_error_id(PyExc_RuntimeError, "Rule %s is left recursive", r->names[w]);
+                goto done;
+            }
+            if (state[w] == 0) {
+                state[w] = 1;
+                frames[fp] = w;
+                framepos[fp++] = first[w];
+            }
+        }
+    }
+
+    /* Loops without calls were checked when they were built */
+    for (i = 0; i < r->nrules; i++) {
+        int from = r->positions[i];
+        int to = from + (int)patsize(r->rules[i]);
+        int lastopen = 0;  /* more recent OpenCall seen in the code */
+        for (k = from; k < to; k += sizei(op + k)) {
+            if (op[k].i.code == IPartialCommit && op[k].i.offset < 0) {
+                int start = dest(op, k);
+                if (start <= lastopen && nullscan(&v, start, k, NULL, NULL)) {
+                    set_error_id(PyExc_RuntimeError, "Possible infinite loop in rule %s", r->names[i]);
+                    goto done;
+                }
+            }
+            else if (op[k].i.code == IOpenCall)
+                lastopen = k;
+        }
+    }
+    ret = 0;
+
+done:
+    PyMem_Del(calls);
+    PyMem_Del(first);
+    PyMem_Del(state);
+    free_verifier(&v);
+    return ret;
+}
+
+/* Rules which are not recursive, and whose code (once their own callees are
+ * inlined) is at most this many instructions, are inlined at their call
+ * sites rather than called.
+ */
+#define MAXINLINE 24
+
+typedef struct RuleInfo {
+    int start;          /* position of the rule in the grammar */
+    int len;            /* size of the rule, including its IRet */
+    int size;           /* size of the rule body with callees inlined */
+    int index;          /* visiting order, for finding recursive rules */
+    int low;
+    byte onstack;
+    byte recursive;
+    byte live;          /* reachable from the initial rule */
+    Instruction *code;  /* expanded body, if the rule is inlined */
+} RuleInfo;
+
+/* Copy the n instructions at p to out, replacing calls to inlined rules by
+ * the rule bodies and correcting jumps around them. callee gives the rule
+ * called by each IOpenCall (or -1), indexed like p. newpos must have room
+ * for n + 1 entries. If out is NULL, only return the size of the result.
+ */
+static int expandrule(const Instruction *p, int n, const int *callee,
+                      const RuleInfo *info, Instruction *out, int *newpos) {
+    int i;
+    int size = 0;
+    for (i = 0; i < n; i += sizei(p + i)) {
+        newpos[i] = size;
+        if (callee[i] >= 0 && info[callee[i]].code)
+            size += info[callee[i]].size;
+        else
+            size += sizei(p + i);
+    }
+    newpos[n] = size;
+    if (out == NULL)
+        return size;
+    for (i = 0; i < n; i += sizei(p + i)) {
+        Instruction *o = out + newpos[i];
+        if (callee[i] >= 0 && info[callee[i]].code) {
+            const RuleInfo *c = info + callee[i];
+            memcpy(o, c->code, c->size * sizeof(Instruction));
+            continue;
+        }
+        memcpy(o, p + i, sizei(p + i) * sizeof(Instruction));
+        if (isjmp(p + i) || istest(p + i))
+            o->i.offset = newpos[dest(p, i)] - newpos[i];
+        else if (p[i].i.code == IDispatch) {
+            int k;
+            for (k = 0; k <= p[i].i.aux; k++)
+                dispatchtarget(o, k) =
+                    newpos[i + dispatchtarget(p + i, k)] - newpos[i];
+        }
+    }
+    return size;
+}
+
+/* Find the recursive rules (those in a cycle of calls), using Tarjan's
+ * algorithm. The components are completed callees first, so the bodies of
+ * small non-recursive rules can be expanded as they are found.
+ */
+static int planinline(const Instruction *op, RuleInfo *info, int nrules,
+                      const int *callee, int *newpos) {
+    int *stack = PyMem_New(int, nrules * 3);
+    int *frames, *framepos;
+    int sp = 0, fp = 0, counter = 0;
+    int root;
+
+    if (stack == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    frames = stack + nrules;
+    framepos = frames + nrules;
+    for (root = 0; root < nrules; root++) {
+        if (info[root].index >= 0)
+            continue;
+        info[root].index = info[root].low = counter++;
+        info[root].onstack = 1;
+        stack[sp++] = root;
+        frames[fp] = root;
+        framepos[fp++] = info[root].start;
+        while (fp > 0) {
+            int v = frames[fp - 1];
+            int k = framepos[fp - 1];
+            if (k < info[v].start + info[v].len - 1) {
+                int w = callee[k];
+                framepos[fp - 1] = k + sizei(op + k);
+                if (w < 0)
+                    continue;
+                if (w == v)
+                    info[v].recursive = 1;
+                if (info[w].index < 0) {
+                    info[w].index = info[w].low = counter++;
+                    info[w].onstack = 1;
+                    stack[sp++] = w;
+                    frames[fp] = w;
+                    framepos[fp++] = info[w].start;
+                }
+                else if (info[w].onstack && info[w].index < info[v].low)
+                    info[v].low = info[w].index;
+                continue;
+            }
+            if (--fp > 0 && info[v].low < info[frames[fp - 1]].low)
+                info[frames[fp - 1]].low = info[v].low;
+            if (info[v].low != info[v].index)
+                continue;
+            if (stack[sp - 1] != v) {
+                int w;
+                do {
+                    w = stack[--sp];
+                    info[w].onstack = 0;
+                    info[w].recursive = 1;
+                } while (w != v);
+                continue;
+            }
+            info[v].onstack = 0;
+            --sp;
+            if (info[v].recursive)
+                continue;
+            info[v].size = expandrule(op + info[v].start, info[v].len - 1,
+                                      callee + info[v].start, info, NULL, newpos);
+            if (info[v].size > MAXINLINE)
+                continue;
+            info[v].code = PyMem_New(Instruction, info[v].size);
+            if (info[v].code == NULL) {
+                PyMem_Del(stack);
+                PyErr_NoMemory();
+                return -1;
+            }
+            expandrule(op + info[v].start, info[v].len - 1, callee + info[v].start,
+                       info, info[v].code, newpos);
+        }
+    }
+    PyMem_Del(stack);
+    return 0;
+}
+
+/* Inline small non-recursive rules, and drop rules which cannot be reached
+ * from the initial rule. The grammar has already been checked, so this only
+ * changes how it is laid out. On success, the program of result and
+ * r->positions describe the new layout; dropped rules have position -1.
+ */
+static int optimizegrammar(PyObject *result, RuleData *r, int init) {
+    Instruction *op = patprog(result);
+    int total = (int)r->totalsize;
+    int nrules = r->nrules;
+    RuleInfo *info = PyMem_New(RuleInfo, nrules);
+    int *callee = PyMem_New(int, total + 1);
+    int *newpos = PyMem_New(int, total + 1);
+    int *work = NULL;
+    Instruction *code = NULL;
+    int i, pos, size, top = 0, changed = 0, ret = -1;
+
+    if (info == NULL || callee == NULL || newpos == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    memset(info, 0, nrules * sizeof(RuleInfo));
+
+    for (i = 0; i < nrules; i++) {
+        info[i].start = r->positions[i];
+        info[i].len = patsize(r->rules[i]) + 1;
+        info[i].index = -1;
+    }
+    for (i = 0; i <= total; i++)
+        callee[i] = -1;
+    for (i = 2; i < total; i += sizei(op + i)) {
+        if (op[i].i.code == IOpenCall)
+            callee[i] = op[i].i.offset;
+    }
+
+    if (planinline(op, info, nrules, callee, newpos) == -1)
+        goto done;
+
+    /* Mark the rules reachable from the initial rule */
+    work = PyMem_New(int, nrules);
+    if (work == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    info[init].live = 1;
+    work[top++] = init;
+    while (top > 0) {
+        int v = work[--top];
+        for (i = info[v].start; i < info[v].start + info[v].len - 1; i += sizei(op + i)) {
+            int w = callee[i];
+            if (w >= 0 && !info[w].live) {
+                info[w].live = 1;
+                work[top++] = w;
+            }
+        }
+    }
+
+    /* Lay out the rules that still need to be called */
+    for (size = 2, i = 0; i < nrules; i++) {
+        if (info[i].code)
+            changed = 1;
+        if (!info[i].live || (info[i].code && i != init)) {
+            changed = 1;
+            info[i].live = 0;
+            continue;
+        }
+        if (!info[i].code)
+            info[i].size = expandrule(op + info[i].start, info[i].len - 1,
+                                      callee + info[i].start, info, NULL, newpos);
+        size += info[i].size + 1;
+    }
+    if (!changed || size >= MAXPATTSIZE - 1) {
+        ret = 0;
+        goto done;
+    }
+
+    code = PyMem_New(Instruction, size + 1);
+    if (code == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    memset(code, 0, (size + 1) * sizeof(Instruction));
+    setinst(code + 1, IJmp, size - 1);
+    for (pos = 2, i = 0; i < nrules; i++) {
+        if (!info[i].live) {
+            r->positions[i] = -1;
+            continue;
+        }
+        r->positions[i] = pos;
+        pos += expandrule(op + info[i].start, info[i].len - 1,
+                          callee + info[i].start, info, code + pos, newpos);
+        setinst(code + pos++, IRet, 0);
+    }
+    setinst(code + size, IEnd, 0);
+
+    PyMem_Del(patprog(result));
+    patprog(result) = code;
+    patlen(result) = size + 1;
+    code = NULL;
+    r->totalsize = size;
+    ret = 0;
+
+done:
+    if (info) {
+        for (i = 0; i < nrules; i++)
+            PyMem_Del(info[i].code);
+    }
+    PyMem_Del(info);
+    PyMem_Del(callee);
+    PyMem_Del(newpos);
+    PyMem_Del(work);
+    PyMem_Del(code);
+    return ret;
+}
+
 static PyObject *Pattern_Grammar (PyObject *cls, PyObject *args, PyObject *kw) {
     PyObject *result = NULL;
     Py_ssize_t i;
     Instruction *p;
     PyObject *init_rule = NULL;
-    PyObject *initpos;
-    Py_ssize_t pos;
+    PyObject *init_id;
+    int init;
     RuleData r;
 
     /* (1) Initialise working storage.
@@ -958,59 +1647,61 @@ static PyObject *Pattern_Grammar (PyObject *cls, PyObject *args, PyObject *kw) {
             goto err;
     }
 
-    /* (3) Loop through the arguments, adding each rule to the rule lists */
+    /* (3) Loop through the arguments, numbering the rules */
     if (loop_args(args, kw, add_rule, &r) == -1)
         goto err;
 
     /* Check that there was at least 1 rule */
-    if (PyList_GET_SIZE(r.rules) == 0) {
+    if (r.nrules == 0) {
         PyErr_SetString(PyExc_ValueError, "Empty grammar");
         goto err;
     }
 
-    /* (4) Build the pattern */
+    /* Check that the initial rule is valid */
+    init_id = PyDict_GetItem(r.ids, init_rule);
+    if (init_id == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Initial rule is not defined in the grammar");
+        goto err;
+    }
+    init = PyInt_AS_LONG(init_id);
+
+    /* (4) Build the pattern, and number the open calls */
     result = new_patt(cls, r.totalsize);
-    if (result == NULL)
+    r.positions = PyMem_New(int, r.nrules);
+    if (result == NULL || r.positions == NULL) {
+        if (r.positions == NULL)
+            PyErr_NoMemory();
         goto err;
+    }
     p = patprog(result);
     ++p; /* Leave space for call */
     setinst(p++, IJmp, r.totalsize - 1);  /* after call, jumps to the end */
 
-    for (i = 0; i < PyList_GET_SIZE(r.rules); ++i) {
-        PyObject *patt = PyList_GET_ITEM(r.rules, i);
-        p += addpatt(result, p, patt);
+    for (i = 0; i < r.nrules; ++i) {
+        r.positions[i] = p - patprog(result);
+        p += addpatt(result, p, r.rules[i]);
         setinst(p++, IRet, 0);
     }
+    if (resolvecalls(result, &r) == -1)
+        goto err;
     /* Go back to first position */
     p = patprog(result);
 
     /* (5) Check the patterns */
-    for (pos = 2, i = 0; i < PyList_GET_SIZE(r.rules); i++) {  /* check all rules */
-        PyObject *patt = PyList_GET_ITEM(r.rules, i);
-        PyObject *ruleid = PyList_GET_ITEM(r.ruleids, i);
-        Py_ssize_t len = patsize(patt) + 1;
-        /* Rule is only needed for error message */
-        if (checkrule(result, pos, pos + len, r.positions, ruleid) == -1)
-            goto err;
-        pos += len;
-    }
+    if (checkgrammar(p, &r) == -1)
+        goto err;
 
-    /* (6) Check that the initial rule is valid, and set up the call */
-    initpos = PyDict_GetItem(r.positions, init_rule);
-    if (initpos == NULL) {
-        PyErr_SetString(PyExc_ValueError, "Initial rule is not defined in the grammar");
+    /* (6) Inline small rules and drop unreachable ones, and set up the call */
+    if (optimizegrammar(result, &r, init) == -1)
         goto err;
-    }
-    pos = PyInt_AS_LONG(initpos);
-    setinst(p, ICall, pos);  /* first instruction calls initial rule */
+    p = patprog(result);
+    setinst(p, ICall, r.positions[init]);  /* first instruction calls initial rule */
 
     /* (7) Correct any open calls (note tail call optimisation here) */
     for (i = 0; i < r.totalsize; i += sizei(p + i)) {
         if (p[i].i.code == IOpenCall) {
-            int pos = getposition(result, r.positions, p[i].i.offset);
+            int pos = r.positions[p[i].i.offset];
             D2("Pos is %d, patching in %d", pos, pos-i);
-            if (pos == -1 && PyErr_Occurred())
-                goto err;
             p[i].i.code = (p[target(p, i + 1)].i.code == IRet) ? IJmp : ICall;
             p[i].i.offset = pos - i;
         }
@@ -1028,12 +1719,542 @@ err:
     return NULL;
 }
 
+/* **********************************************************************
+ * Deferred patterns
+ * **********************************************************************
+ */
+static PyObject *concat_patt(PyObject *self, PyObject *other);
+static PyObject *choicepatts(PyObject *leaves);
+
+/* Create a pattern applying op to self and other, which is compiled when
+ * first needed. Consumes the references to self and other.
+ */
+static PyObject *defer_patt(PyObject *self, PyObject *other, int op) {
+    PyObject *result = PyObject_CallFunction((PyObject *)Py_TYPE(self), "");
+    if (result == NULL) {
+        Py_DECREF(self);
+        Py_DECREF(other);
+        return NULL;
+    }
+    PyMem_Del(patprog(result));
+    patprog(result) = NULL;
+    patlen(result) = 0;
+    patpending(result) = op;
+    ((Pattern *)result)->left = self;
+    ((Pattern *)result)->right = other;
+    return result;
+}
+
+/* The operands of the chain of op operators at the top of patt, in order.
+ * Operands with other pending operators are left uncompiled.
+ *
+ * Only the left operands of a choice are followed, as Python builds
+ * a | b | c as (a | b) | c. A choice on the right is an operand of its
+ * own, compiled first as the operator would have compiled it, as it may
+ * simplify to a set or to true.
+ */
+static PyObject *flattenpatt(PyObject *patt) {
+    int op = patpending(patt);
+    PyObject *leaves = PyList_New(0);
+    PyObject *stack = NULL;
+    if (leaves == NULL)
+        return NULL;
+    if (op == PEND_CHOICE) {
+        for (; patpending(patt) == op; patt = ((Pattern *)patt)->left) {
+            if (PyList_Append(leaves, ((Pattern *)patt)->right) == -1)
+                goto err;
+        }
+        if (PyList_Append(leaves, patt) == -1 || PyList_Reverse(leaves) == -1)
+            goto err;
+        return leaves;
+    }
+    stack = PyList_New(0);
+    if (stack == NULL || PyList_Append(stack, patt) == -1)
+        goto err;
+    while (PyList_GET_SIZE(stack) > 0) {
+        Py_ssize_t top = PyList_GET_SIZE(stack) - 1;
+        PyObject *item = PyList_GET_ITEM(stack, top);
+        int rv;
+        Py_INCREF(item);
+        if (PyList_SetSlice(stack, top, top + 1, NULL) == -1) {
+            Py_DECREF(item);
+            goto err;
+        }
+        if (patpending(item) == op)
+            rv = (PyList_Append(stack, ((Pattern *)item)->right) == -1 ||
+                  PyList_Append(stack, ((Pattern *)item)->left) == -1) ? -1 : 0;
+        else
+            rv = PyList_Append(leaves, item);
+        Py_DECREF(item);
+        if (rv == -1)
+            goto err;
+    }
+    Py_DECREF(stack);
+    return leaves;
+
+err:
+    Py_XDECREF(leaves);
+    Py_XDECREF(stack);
+    return NULL;
+}
+
+/* Simplify the compiled operands of a concatenation, as applying
+ * concat_patt from the left would: true operands are dropped, a fail
+ * operand makes the whole concatenation fail, and adjacent single Any
+ * patterns are merged. Consumes the reference to leaves.
+ */
+static PyObject *simplifyconcat(PyObject *leaves) {
+    Py_ssize_t i, n = PyList_GET_SIZE(leaves);
+    PyObject *result = PyList_New(0);
+    PyObject *last = NULL;  /* Pending Any pattern, not yet in result */
+    if (result == NULL)
+        goto err;
+    for (i = 0; i < n; ++i) {
+        PyObject *leaf = PyList_GET_ITEM(leaves, i);
+        if (issucc(patprog(leaf)))
+            continue;
+        if (isfail(patprog(leaf))) {
+            /* Keep just this operand */
+            Py_XDECREF(last);
+            last = NULL;
+            if (PyList_SetSlice(result, 0, PyList_GET_SIZE(result), NULL) == -1 ||
+                    PyList_Append(result, leaf) == -1)
+                goto err;
+            break;
+        }
+        Py_INCREF(leaf);
+        if (last && isany(patprog(last)) && isany(patprog(leaf))) {
+            last = concat_patt(last, leaf);
+            if (last == NULL)
+                goto err;
+            continue;
+        }
+        if (last && PyList_Append(result, last) == -1) {
+            Py_DECREF(leaf);
+            goto err;
+        }
+        Py_XDECREF(last);
+        last = leaf;
+    }
+    if (last && PyList_Append(result, last) == -1)
+        goto err;
+    Py_XDECREF(last);
+    if (PyList_GET_SIZE(result) == 0 && n > 0 &&
+            PyList_Append(result, PyList_GET_ITEM(leaves, 0)) == -1)
+        goto err;
+    Py_DECREF(leaves);
+    return result;
+
+err:
+    Py_XDECREF(last);
+    Py_XDECREF(result);
+    Py_DECREF(leaves);
+    return NULL;
+}
+
+/* Smallest run of literal alternatives which is matched with a trie */
+#define MINTRIE 16
+
+/* The code of an ITrie instruction is followed by a table giving the
+ * number of the root's child for each byte (or 0), then by a trie of words.
+ * Each node is a header word, (number of children << 1) | 1 if a literal
+ * ends there, then a word per child, (byte << 24) | index of the child's
+ * header, sorted by byte. The root is at index 0.
+ */
+typedef unsigned int TrieWord;
+
+#define TRIETABSIZE     instsize((UCHAR_MAX + 1) * sizeof(unsigned short))
+
+#define triekids(w)     ((int)((w) >> 1))
+#define triefinal(w)    ((w) & 1)
+#define triebyte(w)     ((int)((w) >> 24))
+#define trienode(w)     ((w) & 0xFFFFFF)
+
+typedef struct TrieNode {
+    int kids;   /* First child, or -1 */
+    int next;   /* Next sibling, in byte order, or -1 */
+    int nkids;
+    byte c;
+    byte final;
+} TrieNode;
+
+/* Is patt a non-empty string? */
+static int isliteral(PyObject *patt) {
+    Instruction *p = patprog(patt);
+    if (p->i.code == IEnd)
+        return 0;
+    for (; p->i.code != IEnd; ++p) {
+        if (p->i.code != IChar || p->i.offset != 0)
+            return 0;
+    }
+    return 1;
+}
+
+#define trietable(p)    ((const unsigned short *)((p) + 1))
+#define triewords(p)    ((const TrieWord *)((p) + TRIETABSIZE))
+
+/* The index of the child for byte c of the node at index node, in the trie
+ * of the ITrie instruction at p, or 0 if there is none.
+ */
+static int triechild(const Instruction *p, int node, int c) {
+    const TrieWord *w = triewords(p) + node;
+    int lo = 1, hi = triekids(*w);
+    if (node == 0)
+        return trietable(p)[c] ? trienode(w[trietable(p)[c]]) : 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (triebyte(w[mid]) < c)
+            lo = mid + 1;
+        else if (triebyte(w[mid]) > c)
+            hi = mid - 1;
+        else
+            return trienode(w[mid]);
+    }
+    return 0;
+}
+
+/* The end of the longest literal of the trie at p which matches at s, or
+ * NULL. A literal is left out of the trie when an earlier one is a prefix
+ * of it, as it could never match. So the literals matching at s were given
+ * in the reverse order of their length, and the longest one is the one an
+ * ordered choice would have matched.
+ */
+static const char *triematch(const Instruction *p, const char *s,
+                             const char *e) {
+    const TrieWord *t = triewords(p);
+    const char *r = NULL;
+    int node = 0;
+    while (s < e && (node = triechild(p, node, (byte)*s)) != 0) {
+        s++;
+        if (triefinal(t[node]))
+            r = s;
+    }
+    return r;
+}
+
+/* A pattern matching the ordered choice of the literals in leaves[from:to]
+ * with a single ITrie instruction.
+ */
+static PyObject *triepatt(PyObject *leaves, Py_ssize_t from, Py_ssize_t to) {
+    Py_ssize_t i, chars = 0;
+    TrieNode *nodes = NULL;
+    int *queue = NULL;
+    int *pos = NULL;
+    int nnodes = 1, nwords, q, qn;
+    Py_ssize_t size;
+    TrieWord *t;
+    PyObject *result = NULL;
+
+    for (i = from; i < to; ++i)
+        chars += patsize(PyList_GET_ITEM(leaves, i));
+    nodes = PyMem_New(TrieNode, chars + 1);
+    queue = PyMem_New(int, chars + 1);
+    pos = PyMem_New(int, chars + 1);
+    if (!nodes || !queue || !pos) {
+        PyErr_NoMemory();
+        goto ret;
+    }
+    nodes[0].kids = -1;
+    nodes[0].nkids = 0;
+    nodes[0].final = 0;
+
+    for (i = from; i < to; ++i) {
+        PyObject *leaf = PyList_GET_ITEM(leaves, i);
+        Instruction *p = patprog(leaf);
+        int len = (int)patsize(leaf);
+        int node = 0, k;
+        /* Nodes are only added past the last final node on the path */
+        for (k = 0; k < len && !nodes[node].final; ++k) {
+            int *link = &nodes[node].kids;
+            while (*link >= 0 && nodes[*link].c < p[k].i.aux)
+                link = &nodes[*link].next;
+            if (*link < 0 || nodes[*link].c != p[k].i.aux) {
+                TrieNode *n = &nodes[nnodes];
+                n->kids = -1;
+                n->next = *link;
+                n->nkids = 0;
+                n->c = p[k].i.aux;
+                n->final = 0;
+                nodes[node].nkids++;
+                *link = nnodes++;
+            }
+            node = *link;
+        }
+        if (k == len)
+            nodes[node].final = 1;
+    }
+
+    /* Lay the nodes out breadth first */
+    queue[0] = 0;
+    pos[0] = 0;
+    nwords = 1 + nodes[0].nkids;
+    for (q = 0, qn = 1; q < qn; ++q) {
+        int c;
+        for (c = nodes[queue[q]].kids; c >= 0; c = nodes[c].next) {
+            pos[c] = nwords;
+            nwords += 1 + nodes[c].nkids;
+            queue[qn++] = c;
+        }
+    }
+    size = TRIETABSIZE + (nwords * sizeof(TrieWord) +
+                          sizeof(Instruction) - 1) / sizeof(Instruction);
+    result = empty_patt(PyList_GET_ITEM(leaves, from), size);
+    if (result == NULL)
+        goto ret;
+    setinst(patprog(result), ITrie, size);
+    t = (TrieWord *)(patprog(result) + TRIETABSIZE);
+    for (q = 0; q < qn; ++q) {
+        TrieNode *n = &nodes[queue[q]];
+        TrieWord *w = t + pos[queue[q]];
+        int c, j = 1;
+        w[0] = ((TrieWord)n->nkids << 1) | n->final;
+        for (c = n->kids; c >= 0; c = nodes[c].next) {
+            if (q == 0)
+                ((unsigned short *)(patprog(result) + 1))[nodes[c].c] = j;
+            w[j++] = ((TrieWord)nodes[c].c << 24) | pos[c];
+        }
+    }
+
+ret:
+    PyMem_Del(nodes);
+    PyMem_Del(queue);
+    PyMem_Del(pos);
+    return result;
+}
+
+/* Replace each run of at least MINTRIE literal operands of a choice, some
+ * longer than a character, by a trie. Runs of single characters are left
+ * to choicepatts, which merges them into a set. Consumes the reference to
+ * leaves.
+ */
+static PyObject *simplifychoice(PyObject *leaves) {
+    Py_ssize_t i, j, n = PyList_GET_SIZE(leaves);
+    PyObject *result = PyList_New(0);
+    if (result == NULL)
+        goto err;
+    for (i = 0; i < n; i = j) {
+        int multi = 0;
+        for (j = i; j < n && isliteral(PyList_GET_ITEM(leaves, j)); ++j)
+            multi |= patsize(PyList_GET_ITEM(leaves, j)) > 1;
+        if (j - i >= MINTRIE && multi) {
+            PyObject *trie = triepatt(leaves, i, j);
+            int rv = (trie == NULL) ? -1 : PyList_Append(result, trie);
+            Py_XDECREF(trie);
+            if (rv == -1)
+                goto err;
+            continue;
+        }
+        if (j == i)
+            ++j;
+        for (; i < j; ++i) {
+            if (PyList_Append(result, PyList_GET_ITEM(leaves, i)) == -1)
+                goto err;
+        }
+    }
+    Py_DECREF(leaves);
+    return result;
+
+err:
+    Py_XDECREF(result);
+    Py_DECREF(leaves);
+    return NULL;
+}
+
+/* Apply op to the compiled patterns in leaves.
+ *
+ * The operands of a concatenation are copied into the result in a single
+ * pass, so that building a long sequence takes linear time.
+ *
+ * Choices are built by choicepatts, with the same code as the chain of
+ * operators gave.
+ */
+static PyObject *combinepatts(PyObject *leaves, int op) {
+    Py_ssize_t i, n = PyList_GET_SIZE(leaves);
+    Py_ssize_t size = 0;
+    PyObject *result = PyList_GET_ITEM(leaves, 0);
+    Instruction *p;
+
+    if (op == PEND_CHOICE)
+        return choicepatts(leaves);
+    if (n == 1) {
+        Py_INCREF(result);
+        return result;
+    }
+
+    for (i = 0; i < n; ++i)
+        size += patsize(PyList_GET_ITEM(leaves, i));
+    result = empty_patt(PyList_GET_ITEM(leaves, 0), size);
+    if (result == NULL)
+        return NULL;
+    p = patprog(result);
+    for (i = 0; i < n; ++i) {
+        Py_ssize_t sz = addpatt(result, p, PyList_GET_ITEM(leaves, i));
+        if (sz == -1) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        p += sz;
+    }
+    optimizecaptures(patprog(result));
+    return result;
+}
+
+/* Give patt the program and environment of the compiled pattern src, and
+ * drop its operands. Consumes the reference to src.
+ */
+static int takeprog(PyObject *patt, PyObject *src) {
+    if (Py_REFCNT(src) == 1) {
+        patprog(patt) = patprog(src);
+        patprog(src) = NULL;
+        patenv(patt) = patenv(src);
+        patenv(src) = NULL;
+        patlen(patt) = patlen(src);
+    }
+    else {
+        /* An operand returned unchanged, which is still in use */
+        Instruction *p = PyMem_New(Instruction, patlen(src));
+        if (p == NULL) {
+            Py_DECREF(src);
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(p, patprog(src), patlen(src) * sizeof(Instruction));
+        patprog(patt) = p;
+        patlen(patt) = patlen(src);
+        Py_XINCREF(patenv(src));
+        patenv(patt) = patenv(src);
+    }
+    Py_DECREF(src);
+    patflags(patt) = 0;
+    patpending(patt) = PEND_NONE;
+    Py_CLEAR(((Pattern *)patt)->left);
+    Py_CLEAR(((Pattern *)patt)->right);
+    return 0;
+}
+
+/* Generate the code of patt, if it was built by + or | and has not been
+ * compiled yet. Chains of the same operator are compiled together, and
+ * operands with other pending operators are compiled first, using an
+ * explicit stack rather than recursion, as chains can be very long.
+ */
+static int pattcompile(PyObject *patt) {
+    PyObject *todo;
+    if (patpending(patt) == PEND_NONE)
+        return 0;
+    todo = PyList_New(0);
+    if (todo == NULL || PyList_Append(todo, patt) == -1)
+        goto err;
+    while (PyList_GET_SIZE(todo) > 0) {
+        Py_ssize_t top = PyList_GET_SIZE(todo) - 1;
+        PyObject *node = PyList_GET_ITEM(todo, top);
+        PyObject *leaves;
+        PyObject *result;
+        Py_ssize_t i, n;
+        if (patpending(node) != PEND_NONE) {
+            leaves = flattenpatt(node);
+            if (leaves == NULL)
+                goto err;
+            n = PyList_GET_SIZE(leaves);
+            for (i = 0; i < n; ++i) {
+                PyObject *leaf = PyList_GET_ITEM(leaves, i);
+                if (patpending(leaf) != PEND_NONE &&
+                        PyList_Append(todo, leaf) == -1) {
+                    Py_DECREF(leaves);
+                    goto err;
+                }
+            }
+            if (PyList_GET_SIZE(todo) - 1 > top) {
+                /* Compile the operands first */
+                Py_DECREF(leaves);
+                continue;
+            }
+            if (patpending(node) == PEND_CONCAT &&
+                    (leaves = simplifyconcat(leaves)) == NULL)
+                goto err;
+            if (patpending(node) == PEND_CHOICE &&
+                    (leaves = simplifychoice(leaves)) == NULL)
+                goto err;
+            result = combinepatts(leaves, patpending(node));
+            Py_DECREF(leaves);
+            if (result == NULL || takeprog(node, result) == -1)
+                goto err;
+        }
+        if (PyList_SetSlice(todo, top, top + 1, NULL) == -1)
+            goto err;
+    }
+    Py_DECREF(todo);
+    return 0;
+
+err:
+    Py_XDECREF(todo);
+    return -1;
+}
+
 /* **********************************************************************
  * Pattern methods
  * **********************************************************************
  */
+static PyObject *Pattern_compile(PyObject* self) {
+    if (pattcompile(self) == -1)
+        return NULL;
+    Py_INCREF(self);
+    return self;
+}
+
+/* Patterns returned by Pattern.intern(), keyed by themselves. The table
+ * holds the only references to patterns nobody else uses any more; these
+ * are dropped whenever it grows to intern_limit entries.
+ */
+static PyObject *intern_table = NULL;
+static Py_ssize_t intern_limit = 256;
+
+/* Drop the interned patterns that are referenced only by the table */
+static int intern_purge(void) {
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    PyObject *table = PyDict_New();
+    if (table == NULL)
+        return -1;
+    while (PyDict_Next(intern_table, &pos, &key, &value)) {
+        /* The table holds two references, as key and as value */
+        if (Py_REFCNT(value) > 2 && PyDict_SetItem(table, key, value) == -1) {
+            Py_DECREF(table);
+            return -1;
+        }
+    }
+    Py_DECREF(intern_table);
+    intern_table = table;
+    intern_limit = PyDict_Size(table) * 2;
+    if (intern_limit < 256)
+        intern_limit = 256;
+    return 0;
+}
+
+static PyObject *Pattern_intern(PyObject* self) {
+    PyObject *result;
+    if (intern_table == NULL && (intern_table = PyDict_New()) == NULL)
+        return NULL;
+    result = PyDict_GetItem(intern_table, self);
+    if (result == NULL) {
+        if (PyDict_Size(intern_table) >= intern_limit && intern_purge() == -1)
+            return NULL;
+        if (PyDict_SetItem(intern_table, self, self) == -1)
+            return NULL;
+        result = self;
+    }
+    else if (Py_TYPE(result) != Py_TYPE(self)) {
+        /* Only share patterns of the same class */
+        result = self;
+    }
+    Py_INCREF(result);
+    return result;
+}
+
 static PyObject *Pattern_env(PyObject* self) {
-    PyObject *env = patenv(self);
+    PyObject *env;
+    if (pattcompile(self) == -1)
+        return NULL;
+    env = patenv(self);
     if (env == NULL)
         Py_RETURN_NONE;
     Py_INCREF(env);
@@ -1041,25 +2262,33 @@ static PyObject *Pattern_env(PyObject* self) {
 }
 
 static PyObject *Pattern_display(Pattern* self) {
+    if (pattcompile((PyObject *)self) == -1)
+        return NULL;
     printpatt(patprog(self));
     Py_RETURN_NONE;
 }
 
+/* Names of the capture kinds, indexed by CapKind */
+static char *capkindnames[] = {
+    "Close", "Position", "Const", "Backref", "Arg", "Simple",
+    "Table", "Function", "Query", "String", "Subst", "Fold",
+    "Runtime", "Group", "Span", "Convert" };
+
 static PyObject *Pattern_dump(Pattern *self) {
-    PyObject *result = PyList_New(0);
-    Instruction *p = patprog(self);
+    PyObject *result;
+    Instruction *p;
 
+    if (pattcompile((PyObject *)self) == -1)
+        return NULL;
+    result = PyList_New(0);
     if (result == NULL)
         return NULL;
+    p = patprog(self);
 
     for (;;) {
         PyObject *item;
         char cset[256];
         int cs_len = 0;
-        static char *kinds[] = {
-            "Close", "Position", "Const", "Backref", "Arg", "Simple",
-            "Table", "Function", "Query", "String", "Subst", "Fold",
-            "Runtime", "Group" };
 
         if (hascharset(p)) {
             int i;
@@ -1069,15 +2298,32 @@ static PyObject *Pattern_dump(Pattern *self) {
                 }
             }
         }
+        else if (p->i.code == IDispatch) {
+            int i;
+            for (i = 0; i < 256; ++i) {
+                if ((p+1)->buff[i] != 0) {
+                    cset[cs_len++] = i;
+                }
+            }
+        }
+        else if (p->i.code == ITrie) {
+            int i;
+            for (i = 0; i < 256; ++i) {
+                if (trietable(p)[i] != 0) {
+                    cset[cs_len++] = i;
+                }
+            }
+        }
 
         /* Instruction, aux, offset, cset, capkind, capoff, jmpdest */
         item = Py_BuildValue("(siis#sii)",
                 INAME(p->i.code),
                 p->i.aux, p->i.offset,
                 cset, cs_len,
-                iscapture(p) ? kinds[getkind(p)] : "",
+                iscapture(p) ? capkindnames[getkind(p)] : "",
                 iscapture(p) ? getoff(p) : 0,
-                isprop(p, ISJMP|ISCHECK) ? dest(0,p) == p ? -1 : dest(0,p) - patprog(self) : 0);
+                isprop(p, ISJMP|ISCHECK) ? dest(0,p) == p ? -1 : dest(0,p) - patprog(self) :
+                p->i.code == IDispatch ? p + dispatchtarget(p, 0) - patprog(self) : 0);
         if (item == NULL) {
             Py_DECREF(result);
             return NULL;
@@ -1112,44 +2358,95 @@ static PyObject *Pattern_set_code(Pattern* self, PyObject *args) {
  * **********************************************************************
  */
 /* Rich comparison */
+/* Check that the environment values used by the program of p1 are equal
+ * to those of p2, which has the same program.
+ */
+static int sameenv(PyObject *p1, PyObject *p2) {
+    Instruction *p;
+    for (p = patprog(p1); p->i.code != IEnd; p += sizei(p)) {
+        if (isfenvoff(p) && p->i.offset != 0) {
+            int idx = p->i.offset - 1;
+            int rv = PyObject_RichCompareBool(PyList_GET_ITEM(patenv(p1), idx),
+                                              PyList_GET_ITEM(patenv(p2), idx),
+                                              Py_EQ);
+            if (rv != 1)
+                return rv;
+        }
+    }
+    return 1;
+}
+
 static PyObject *Pattern_richcompare(PyObject *self, PyObject *other, int op) {
-    if (op != Py_EQ && op != Py_NE) {
+    int rv;
+    if ((op != Py_EQ && op != Py_NE) ||
+            !PyObject_IsInstance(other, pattern_cls)) {
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
 
-    /* Two patterns are equal if their code and length are equal */
-    if (patlen(self) != patlen(other)) {
-        goto ret_ne;
-    }
-    if (memcmp(patprog(self), patprog(other), patlen(self)) != 0) {
-        goto ret_ne;
-    }
+    if (pattcompile(self) == -1 || pattcompile(other) == -1)
+        return NULL;
 
-    /* We're equal */
-    if (op == Py_EQ)
-        Py_RETURN_TRUE;
-    else
-        Py_RETURN_FALSE;
+    /* Two patterns are equal if their code and the values it uses from
+     * their environments are equal
+     */
+    if (self == other)
+        rv = 1;
+    else if (patlen(self) != patlen(other) ||
+            memcmp(patprog(self), patprog(other),
+                   patlen(self) * sizeof(Instruction)) != 0)
+        rv = 0;
+    else if ((rv = sameenv(self, other)) == -1)
+        return NULL;
 
-ret_ne:
-    if (op == Py_NE)
+    if (rv == (op == Py_EQ))
         Py_RETURN_TRUE;
     else
         Py_RETURN_FALSE;
 }
 
-/* Concatenate 2 patterns */
-PyObject *Pattern_concat(PyObject *self, PyObject *other) {
+/* Hash the code of a pattern, as for a string, and the environment values
+ * it uses. Values that are not hashable, such as tables, contribute their
+ * type only.
+ */
+static long Pattern_hash(PyObject *self) {
+    unsigned char *s;
+    Py_ssize_t len;
+    Instruction *p;
+    long x;
+
+    if (pattcompile(self) == -1)
+        return -1;
+    s = (unsigned char *)patprog(self);
+    len = patlen(self) * sizeof(Instruction);
+    x = *s << 7;
+    while (--len >= 0)
+        x = (1000003 * x) ^ *s++;
+    x ^= patlen(self);
+    for (p = patprog(self); p->i.code != IEnd; p += sizei(p)) {
+        if (isfenvoff(p) && p->i.offset != 0) {
+            PyObject *v = PyList_GET_ITEM(patenv(self), p->i.offset - 1);
+            long h = PyObject_Hash(v);
+            if (h == -1) {
+                if (!PyErr_ExceptionMatches(PyExc_TypeError))
+                    return -1;
+                PyErr_Clear();
+                h = _Py_HashPointer(Py_TYPE(v));
+            }
+            x = (1000003 * x) ^ h;
+        }
+    }
+    if (x == -1)
+        x = -2;
+    return x;
+}
+
+/* Concatenate 2 compiled patterns, consuming the references to them */
+static PyObject *concat_patt(PyObject *self, PyObject *other) {
     Instruction *p1;
     Instruction *p2;
     PyObject *result;
 
-    if (ensure_patterns(&self, &other) == -1) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
-    }
-
     p1 = patprog(self);
     p2 = patprog(other);
 
@@ -1191,10 +2488,14 @@ ret:
 
 /* Assert that pattern self matches at the current position */
 PyObject *Pattern_and(PyObject *self) {
-    Instruction *p1 = patprog(self);
+    Instruction *p1;
     CharsetTag st1;
     PyObject *result;
 
+    if (pattcompile(self) == -1)
+        return NULL;
+    p1 = patprog(self);
+
     if (isfail(p1) || issucc(p1)) {
         /* &fail == fail; &true == true */
         Py_INCREF(self);
@@ -1235,6 +2536,11 @@ static PyObject *Pattern_diff(PyObject *self, PyObject *other) {
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
+    if (pattcompile(self) == -1 || pattcompile(other) == -1) {
+        Py_DECREF(self);
+        Py_DECREF(other);
+        return NULL;
+    }
 
     if (tocharset(patprog(self), &st1) == ISCHARSET &&
             tocharset(patprog(other), &st2) == ISCHARSET) {
@@ -1277,9 +2583,13 @@ static PyObject *Pattern_diff(PyObject *self, PyObject *other) {
 
 /* Assert that self does not match here */
 static PyObject *Pattern_negate (PyObject *self) {
-    Instruction *p = patprog(self);
+    Instruction *p;
     PyObject *result;
 
+    if (pattcompile(self) == -1)
+        return NULL;
+    p = patprog(self);
+
     if (isfail(p)) {  /* -false? */
         result = empty_patt(self, 0); /* true */
     }
@@ -1351,14 +2661,9 @@ static PyObject *repeats(PyObject *patt, Py_ssize_t n) {
     if (result == NULL)
         return NULL;
 
-    /* Note - in verifier, there is a commented-out piece of code relating to
-     * fenv lookups which needs fixing. This appears to be only relevant for
-     * grammars.
-     * TODO: Fix this when implementing grammars.
-     */
     p = patprog(patt);
-    switch (verify(result, p, p, p + len, NULL, NULL)) {
-        case 0:
+    switch (acceptsempty(p, len)) {
+        case 1:
             PyErr_SetString(PyExc_ValueError, "Loop body may accept empty string");
             /* Fall through */
         case -1:
@@ -1415,11 +2720,14 @@ static PyObject *optionals(PyObject *patt, int n) {
 /* Repetition operator */
 static PyObject *Pattern_pow (PyObject *self, PyObject *other, PyObject *modulo) {
     long n = PyInt_AsLong(other);
-    Instruction *p1 = patprog(self);
+    Instruction *p1;
     /* Ignore modulo argument - not meaningful */
 
     if (n == -1 && PyErr_Occurred())
         return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
+    p1 = patprog(self);
 
     if (n >= 0) {
         CharsetTag st;
@@ -1448,138 +2756,297 @@ static PyObject *Pattern_pow (PyObject *self, PyObject *other, PyObject *modulo)
 
 /* Helper functions for ordered choice operator */
 
-/* Create a new empty pattern, size *size + extra. Copy self's environment
- * across. Add extra to *size and set *pptr to start of extra space.
- */
-static PyObject *auxnew (PyObject *self, int *size, int extra, Instruction **pptr) {
-    PyObject *result;
+/* Smallest run of parts starting with a test which gets a dispatch */
+#define MINDISPATCH 4
 
-    result = empty_patt(self, *size + extra);
-    if (result == NULL)
-        return NULL;
-    mergeenv(result, self);
-    *size += extra;
-    *pptr = patprog(result) + *size - extra;
-    return result;
+/* A run of instructions in the ordered choice being built by choicepatts.
+ * Parts end with a jump to the end of the choice. A part ending in IJmp
+ * (test; p; jmp) is changed to test; choice; p; commit if a later
+ * alternative may start with the same character.
+ */
+typedef struct ChoicePiece {
+    Instruction *code;
+    int len;
+    int leaf;   /* Operand owning the code, for the env correction, or -1 */
+    int born;   /* Alternatives after this one are checked against it */
+    int fixed;  /* 1 if it ends in ICommit, -1 if it keeps its test */
+    int dispatch;  /* Parts in the run dispatched from here, or 0 */
+} ChoicePiece;
+
+/* Can a dispatch jump straight to this part? Its test fails to the start
+ * of the next part, so it only has to be the first part whose test accepts
+ * the next character.
+ */
+static int dispatchable(const ChoicePiece *part) {
+    return part->fixed != 1 &&
+        (part->code->i.code == IChar || part->code->i.code == ISet);
 }
 
-static PyObject *basic_union (PyObject *self, PyObject *other,
-        Instruction *p1, int l1, int *size, CharsetTag *st2) {
-    PyObject *result;
-    CharsetTag st1;
-    tocharset(p1, &st1);
-    if (st1.tag == ISCHARSET && st2->tag == ISCHARSET) {
-        Instruction *p;
-        result = auxnew(self, size, CHARSETINSTSIZE, &p);
-        setinst(p, ISet, 0);
-        loopset(i, p[1].buff[i] = st1.cs[i] | st2->cs[i]);
+/* Build the dispatch for the n parts starting at part. The offsets of the
+ * targets are filled in when the parts are copied.
+ */
+static void setdispatch(Instruction *p, const ChoicePiece *part, int n) {
+    byte *table = (p+1)->buff;
+    int k, c;
+    setinstaux(p, IDispatch, DISPATCHTABSIZE + n + 1, n);
+    memset(table, 0, UCHAR_MAX + 1);
+    for (k = 0; k < n; ++k) {
+        const Instruction *t = part[k].code;
+        for (c = 0; c <= UCHAR_MAX; ++c) {
+            if (table[c] == 0 && (t->i.code == IChar ? c == t->i.aux :
+                                  testchar((t+1)->buff, c)))
+                table[c] = k + 1;
+        }
     }
-    else if (exclusive(&st1, st2) || isheadfail(p1)) {
-        Instruction *p;
-        result = auxnew(self, size, l1 + 1 + patsize(other), &p);
-        if (result == NULL)
-            return result;
-        copypatt(p, p1, l1);
-        check2test(p, l1 + 1);
-        p += l1;
-        setinst(p++, IJmp, patsize(other) + 1);
-        addpatt(result, p, other);
+}
+
+/* Split the code of an alternative into its parts and its tail
+ * (the code after the last part).
+ */
+static void splitchoice(ChoicePiece *parts, int *nparts, ChoicePiece *tail,
+                        Instruction *p, int l, int leaf, int born) {
+    int sp;
+    for (;;) {
+        ChoicePiece *part;
+        if (l > 0 && p->i.code == IDispatch &&
+                firstpart(p + sizei(p), l - sizei(p)) != 0) {
+            /* Dispatches are rebuilt for the whole choice */
+            l -= sizei(p);
+            p += sizei(p);
+        }
+        if ((sp = firstpart(p, l)) == 0)
+            break;
+        part = &parts[(*nparts)++];
+        part->code = p;
+        part->len = sp;
+        part->leaf = leaf;
+        part->born = born;
+        part->fixed = (p[sp - 1].i.code == ICommit);
+        p += sp;
+        l -= sp;
+    }
+    tail->code = p;
+    tail->len = l;
+    tail->leaf = leaf;
+}
+
+/* Ordered choice of the compiled patterns in leaves.
+ *
+ * This builds the same code as applying the operator to one alternative
+ * at a time, but in linear time. That copies the whole choice for every
+ * alternative, and rechecks each part against the new alternative. Here, the
+ * parts are collected once, and each part is checked against the union of
+ * the first characters of all later alternatives, which gives the same
+ * answer as checking them one at a time.
+ */
+static PyObject *choicepatts(PyObject *leaves) {
+    Py_ssize_t i, n = PyList_GET_SIZE(leaves);
+    Py_ssize_t first, size = 0;
+    int nparts = 0, nsteps = 0;
+    ChoicePiece *parts = NULL;
+    ChoicePiece tail;
+    CharsetTag *later = NULL;   /* First characters of steps [i:] */
+    int *merged = NULL;         /* Leaves whose env is merged, and corr */
+    Instruction *scratch = NULL;
+    Instruction *sp;
+    PyObject *result = NULL;
+    Instruction *p;
+    Instruction *dp = NULL;     /* Dispatch of the current run */
+    int dk = 0;                 /* Parts of the run copied so far */
+
+    /* fail / a == a */
+    for (first = 0; first < n - 1; ++first)
+        if (!isfail(patprog(PyList_GET_ITEM(leaves, first))))
+            break;
+    result = PyList_GET_ITEM(leaves, first);
+    Py_INCREF(result);
+    /* true / a == true */
+    if (issucc(patprog(result)) || first == n - 1)
+        return result;
+    Py_DECREF(result);
+    result = NULL;
+
+    for (i = first; i < n; ++i)
+        size += patsize(PyList_GET_ITEM(leaves, i)) + CHARSETINSTSIZE + 3;
+    parts = PyMem_New(ChoicePiece, size);
+    later = PyMem_New(CharsetTag, n - first + 1);
+    merged = PyMem_New(int, n);
+    scratch = PyMem_New(Instruction, size);
+    if (!parts || !later || !merged || !scratch) {
+        PyErr_NoMemory();
+        goto ret;
+    }
+    memset(scratch, 0, sizeof(Instruction) * size);
+    sp = scratch;
+    for (i = 0; i < n; ++i)
+        merged[i] = (i == first);
+
+    splitchoice(parts, &nparts, &tail, patprog(PyList_GET_ITEM(leaves, first)),
+                patsize(PyList_GET_ITEM(leaves, first)), first, 0);
+    for (i = first + 1; i < n; ++i) {
+        PyObject *leaf = PyList_GET_ITEM(leaves, i);
+        CharsetTag st1;
+        CharsetTag *st2 = &later[++nsteps];
+        int l1 = tail.len;
+        /* a / fail == a */
+        if (isfail(patprog(leaf))) {
+            --nsteps;
+            continue;
+        }
+        tocharset(patprog(leaf), st2);
+        tocharset(tail.code, &st1);
+        if (st1.tag == ISCHARSET && st2->tag == ISCHARSET) {
+            /* The tail and the alternative merge into a single set */
+            setinst(sp, ISet, 0);
+            loopset(k, sp[1].buff[k] = st1.cs[k] | st2->cs[k]);
+            setinst(sp + CHARSETINSTSIZE, IEnd, 0);
+            tail.code = sp;
+            tail.len = CHARSETINSTSIZE;
+            tail.leaf = -1;
+            sp += CHARSETINSTSIZE + 1;
+            continue;
+        }
+        parts[nparts].code = sp;
+        parts[nparts].leaf = tail.leaf;
+        parts[nparts].born = nsteps;
+        if (exclusive(&st1, st2) || isheadfail(tail.code)) {
+            /* test L1; tail; jmp E; L1: ... */
+            copypatt(sp, tail.code, l1);
+            check2test(sp, l1 + 1);
+            setinst(sp + l1, IJmp, 0);
+            parts[nparts].fixed = 0;
+        }
+        else {
+            /* choice L1; tail; commit E; L1: ... */
+            setinst(sp, IChoice, 1 + l1 + 1);
+            copypatt(sp + 1, tail.code, l1);
+            setinst(sp + 1 + l1, ICommit, 0);
+            optimizechoice(sp);
+            parts[nparts].fixed = 1;
+            ++l1;
+        }
+        parts[nparts++].len = l1 + 1;
+        sp += l1 + 1;
+        merged[i] = 1;
+        splitchoice(parts, &nparts, &tail, patprog(leaf), patsize(leaf),
+                    i, nsteps);
+    }
+
+    /* later[i] = union of the first characters of steps i..nsteps */
+    later[0].tag = NOINFO;
+    for (i = nsteps - 1; i >= 1; --i) {
+        if (later[i + 1].tag == NOINFO)
+            later[i].tag = NOINFO;
+        else if (later[i].tag != NOINFO)
+            loopset(k, later[i].cs[k] |= later[i + 1].cs[k]);
+    }
+
+    /* Parts which must be changed back to a choice */
+    size = tail.len;
+    for (i = 0; i < nparts; ++i) {
+        ChoicePiece *part = &parts[i];
+        if (!part->fixed && (part->born == nsteps ||
+                !interfere(part->code, part->len, &later[part->born + 1])))
+            part->fixed = -1;  /* Keep the test */
+        size += part->len + (part->fixed == 0);
+    }
+
+    /* Runs of parts starting with a test are entered through a dispatch */
+    for (i = 0; i < nparts; ) {
+        Py_ssize_t j = i;
+        while (j < nparts && j - i < UCHAR_MAX && dispatchable(&parts[j]))
+            parts[j++].dispatch = 0;
+        if (j - i >= MINDISPATCH) {
+            parts[i].dispatch = (int)(j - i);
+            size += DISPATCHTABSIZE + (j - i) + 1;
+        }
+        else if (j == i)
+            parts[j++].dispatch = 0;
+        i = j;
     }
-    else {
-        /* choice L1; e1; commit L2; L1: e2; L2: ... */
-        Instruction *p;
-        result = auxnew(self, size, 1 + l1 + 1 + patsize(other), &p);
-        if (result == NULL)
-            return NULL;
-        setinst(p++, IChoice, 1 + l1 + 1);
-        copypatt(p, p1, l1); p += l1;
-        setinst(p++, ICommit, 1 + patsize(other));
-        addpatt(result, p, other);
-        optimizechoice(p - (1 + l1 + 1));
+
+    result = empty_patt(PyList_GET_ITEM(leaves, first), size);
+    if (result == NULL)
+        goto ret;
+    for (i = first; i < n; ++i) {
+        if (merged[i]) {
+            Py_ssize_t corr = mergeenv(result, PyList_GET_ITEM(leaves, i));
+            if (corr == -1) {
+                Py_CLEAR(result);
+                goto ret;
+            }
+            merged[i] = (int)corr;
+        }
     }
+
+    p = patprog(result);
+    for (i = 0; i <= nparts; ++i) {
+        ChoicePiece *part = (i < nparts) ? &parts[i] : &tail;
+        Instruction *start;
+        Instruction *px;
+        if (dp != NULL && dk == dp->i.aux) {
+            dispatchtarget(dp, 0) = (int)(p - dp);  /* end of the run */
+            dp = NULL;
+        }
+        if (i < nparts && part->dispatch) {
+            dp = p;
+            dk = 0;
+            setdispatch(p, part, part->dispatch);
+            p += sizei(p);
+        }
+        if (dp != NULL)
+            dispatchtarget(dp, ++dk) = (int)(p - dp);
+        start = p;
+        if (i < nparts && part->fixed == 0) {
+            /* test L1; choice L1; p; commit E; L1: ... */
+            int sizefirst = sizei(part->code);
+            copypatt(p, part->code, sizefirst);
+            p->i.offset++;
+            p += sizefirst;
+            setinstaux(p++, IChoice, part->len - sizefirst + 1, 1);
+            copypatt(p, part->code + sizefirst, part->len - sizefirst - 1);
+            p += part->len - sizefirst - 1;
+            setinst(p++, ICommit, 0);
+        }
+        else {
+            copypatt(p, part->code, part->len);
+            p += part->len;
+        }
+        if (i < nparts)
+            (p - 1)->i.offset = (int)(patprog(result) + size - (p - 1));
+        if (part->leaf >= 0 && merged[part->leaf] != 0) {
+            for (px = start; px < p; px += sizei(px)) {
+                if (isfenvoff(px) && px->i.offset != 0)
+                    px->i.offset += merged[part->leaf];
+            }
+        }
+    }
+
+ret:
+    PyMem_Del(parts);
+    PyMem_Del(later);
+    PyMem_Del(merged);
+    PyMem_Del(scratch);
     return result;
 }
 
-/* p1/l1 are the start and length of self. size is 0. st2 is the charset tag
- * for other.
- * Firstpart: {TEST->L xxxxx JMP/COMMIT->E L: xxxxx E:} = L
- *            {CHOICE->L xxxxx COMMIT->E: L: xxxxx E:} = L
- *            else 0
- * If self is all 1 part, union with other.
- * Else, if part 1 ends in commit and doesn't interfere with part 2,
- *   return part1 + part2 (with part1 commit adjusted)
- * Else,
- *   return (test1 choice restofp1 commit) + part2
- */
-static PyObject *separateparts (PyObject *self, PyObject *other, 
-        Instruction *p1, int l1, int *size, CharsetTag *st2) {
-    int sp = firstpart(p1, l1);
-    if (sp == 0) /* first part is entire p1? */
-        return basic_union(self, other, p1, l1, size, st2);
-    else if ((p1 + sp - 1)->i.code == ICommit || !interfere(p1, sp, st2)) {
-        Instruction *p;
-        int init = *size;
-        int end = init + sp;
-        *size = end;
-        PyObject *result = separateparts(self, other, p1 + sp, l1 - sp, size, st2);
-        if (result == NULL)
-            return NULL;
-        p = patprog(result);
-        copypatt(p + init, p1, sp);
-        (p + end - 1)->i.offset = *size - (end - 1);
-        return result;
-    }
-    else {  /* must change back to non-optimized choice */
-        Instruction *p;
-        int init = *size;
-        int end = init + sp + 1; /* Needs 1 extra instruction (choice) */
-        int sizefirst = sizei(p1); /* Size of p1's first instruction (the test) */
-        *size = end;
-        PyObject *result = separateparts(self, other, p1 + sp, l1 - sp, size, st2);
-        if (result == NULL)
-            return NULL;
-        p = patprog(result);
-        copypatt(p + init, p1, sizefirst); /* Copy the test */
-        (p + init)->i.offset++; /* Correct jump (because of new instruction) */
-        init += sizefirst;
-        setinstaux(p + init, IChoice, sp - sizefirst + 1, 1);
-        init++;
-        copypatt(p + init, p1 + sizefirst, sp - sizefirst - 1);
-        init += sp - sizefirst - 1;
-        setinst(p + init, ICommit, *size - (end - 1));
-        return result;
+/* Concatenation operator (deferred, see pattcompile) */
+PyObject *Pattern_concat(PyObject *self, PyObject *other) {
+    if (ensure_patterns(&self, &other) == -1) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
     }
+    return defer_patt(self, other, PEND_CONCAT);
 }
 
-/* Ordered choice operator */
+/* Ordered choice operator (deferred, see pattcompile) */
 static PyObject *Pattern_or (PyObject *self, PyObject *other) {
-    int size = 0;
-    Instruction *p1;
-    Instruction *p2;
-    CharsetTag st2;
-    PyObject *result;
     /* Make sure both arguments are patterns */
     if (ensure_patterns(&self, &other) == -1) {
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
-    p1 = patprog(self);
-    p2 = patprog(other);
-    if (isfail(p1)) { /* check for simple identities */
-        Py_DECREF(self);
-        return other; /* fail / a == a */
-    }
-    else if (isfail(p2) || issucc(p1)) {
-        Py_DECREF(other);
-        return self; /* a / fail == a; true / a == true */
-    }
-    else {
-        tocharset(p2, &st2);
-        result = separateparts(self, other, p1, patsize(self), &size, &st2);
-    }
-    Py_DECREF(self);
-    Py_DECREF(other);
-    return result;
+    return defer_patt(self, other, PEND_CHOICE);
 }
 
 int ensure_pattern(PyObject **pat) {
@@ -1606,6 +3073,8 @@ static PyObject *capture_aux(PyObject*cls, PyObject *pat, int kind, PyObject *la
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
+    if (pattcompile(pat) == -1)
+        return NULL;
 
     lc = skipchecks(patprog(pat), 0, &n);
 
@@ -1644,6 +3113,9 @@ static PyObject *capture_aux(PyObject*cls, PyObject *pat, int kind, PyObject *la
 static PyObject *Pattern_Capture(PyObject *cls, PyObject *pat) {
     return capture_aux(cls, pat, Csimple, 0);
 }
+static PyObject *Pattern_CaptureSpan(PyObject *cls, PyObject *pat) {
+    return capture_aux(cls, pat, Cspan, 0);
+}
 static PyObject *Pattern_CaptureTab(PyObject *cls, PyObject *pat) {
     return capture_aux(cls, pat, Ctable, 0);
 }
@@ -1651,6 +3123,69 @@ static PyObject *Pattern_CaptureSub(PyObject *cls, PyObject *pat) {
     return capture_aux(cls, pat, Csubst, 0);
 }
 
+/* A node capture is a table capture with a name */
+static PyObject *Pattern_CaptureNode(PyObject *cls, PyObject *args) {
+    PyObject *pat = NULL;
+    PyObject *name = NULL;
+
+    if (!PyArg_UnpackTuple(args, "CapNode", 2, 2, &pat, &name))
+        return NULL;
+    if (name == Py_None) {
+        PyErr_SetString(PyExc_TypeError, "CapNode name cannot be None");
+        return NULL;
+    }
+    return capture_aux(cls, pat, Ctable, name);
+}
+
+/* Conversion captures. The label is a (conversion, argument) tuple. */
+#define CONV_INT 0
+#define CONV_FLOAT 1
+#define CONV_DECODE 2
+
+static PyObject *convert_aux(PyObject *cls, PyObject *pat, int conv,
+                             PyObject *arg) {
+    PyObject *label = Py_BuildValue("(iO)", conv, arg);
+    PyObject *result;
+    if (label == NULL)
+        return NULL;
+    result = capture_aux(cls, pat, Cconvert, label);
+    Py_DECREF(label);
+    return result;
+}
+
+static PyObject *Pattern_CaptureInt(PyObject *cls, PyObject *args) {
+    PyObject *pat = NULL;
+    PyObject *arg;
+    PyObject *result;
+    int base = 10;
+
+    if (!PyArg_ParseTuple(args, "O|i:CapInt", &pat, &base))
+        return NULL;
+    if ((base != 0 && base < 2) || base > 36) {
+        PyErr_SetString(PyExc_ValueError, "CapInt base must be 0 or 2-36");
+        return NULL;
+    }
+    arg = PyInt_FromLong(base);
+    if (arg == NULL)
+        return NULL;
+    result = convert_aux(cls, pat, CONV_INT, arg);
+    Py_DECREF(arg);
+    return result;
+}
+
+static PyObject *Pattern_CaptureFloat(PyObject *cls, PyObject *pat) {
+    return convert_aux(cls, pat, CONV_FLOAT, Py_None);
+}
+
+static PyObject *Pattern_CaptureDecode(PyObject *cls, PyObject *args) {
+    PyObject *pat = NULL;
+    PyObject *encoding = NULL;
+
+    if (!PyArg_ParseTuple(args, "OS:CapDecode", &pat, &encoding))
+        return NULL;
+    return convert_aux(cls, pat, CONV_DECODE, encoding);
+}
+
 static PyObject *Pattern_CaptureGroup(PyObject *cls, PyObject *args) {
     PyObject *pat = NULL;
     PyObject *id = NULL;
@@ -1680,6 +3215,8 @@ static PyObject *Pattern_CaptureRuntime(PyObject *cls, PyObject *args) {
         Py_INCREF(Py_NotImplemented);
         return Py_NotImplemented;
     }
+    if (pattcompile(pat) == -1)
+        return NULL;
     result = new_patt(cls, 1 + patsize(pat) + 1);
     if (result) {
         Instruction *p = patprog(result);
@@ -1781,9 +3318,17 @@ static PyObject *Pattern_CaptureConst(PyObject *cls, PyObject *args) {
  * Captures - post-match capturing of values
  * **********************************************************************
  */
-int pushsubject(CapState *cs, Capture *c) {
-    PyObject *str = PyString_FromStringAndSize(c->s, c->siz - 1);
+/* Push the subject text from s to e, or its (start, end) offsets if asspan
+ * is set.
+ */
+int pushsubject(CapState *cs, const char *s, const char *e, int asspan) {
+    PyObject *str;
     int ret = 0;
+    if (asspan)
+        str = Py_BuildValue("(nn)", (Py_ssize_t)(s - cs->s),
+                                    (Py_ssize_t)(e - cs->s));
+    else
+        str = PyString_FromStringAndSize(s, e - s);
     if (str == NULL)
         return -1;
     if (PyList_Append(cs->values, str) == -1)
@@ -1794,44 +3339,26 @@ int pushsubject(CapState *cs, Capture *c) {
 
 static int pushcapture (CapState *cs);
 
-static PyObject *getonecapture (CapState *cs) {
-    int n;
-    PyObject *save;
-    PyObject *captures = PyList_New(0);
-    if (captures == NULL)
-        return NULL;
-    save = cs->values;
-    cs->values = captures;
-    n = pushcapture(cs);
-    cs->values = save;
-    if (n == -1) {
-        Py_DECREF(captures);
-        return NULL;
-    }
-    save = PySequence_GetItem(captures, 0);
-    Py_DECREF(captures);
-    return save;
-}
-
 static int pushallvalues (CapState *cs, int addextra) {
     Capture *co = cs->cap;
     int n = 0;
+    int asspan = captype(co) == Cspan ||
+                 (cs->spans && captype(co) == Csimple);
     if (isfullcap(cs->cap++)) {
-        if (pushsubject(cs, co) == -1) /* Push whole match */
+        /* Push whole match */
+        if (pushsubject(cs, capaddr(cs, co), closeaddr(cs, co), asspan) == -1)
             return -1;
         return 1;
     }
-    while (!isclosecap(cs->cap))
-        n += pushcapture(cs);
-    if (addextra || n == 0) {  /* need extra? */
-        PyObject *str = PyString_FromStringAndSize(co->s, cs->cap->s - co->s);
-        if (str == NULL)
+    while (!isclosecap(cs->cap)) {
+        int k = pushcapture(cs);
+        if (k == -1)
             return -1;
-        if (PyList_Append(cs->values, str) == -1) {
-            Py_DECREF(str);
+        n += k;
+    }
+    if (addextra || n == 0) {  /* need extra? */
+        if (pushsubject(cs, capaddr(cs, co), capaddr(cs, cs->cap), asspan) == -1)
             return -1;
-        }
-        Py_DECREF(str);
         /* TODO Why is this a pre-increment? lpeg.c uses a post-increment */
         ++n;
     }
@@ -1839,9 +3366,49 @@ static int pushallvalues (CapState *cs, int addextra) {
     return n;
 }
 
-static int addonestring (PyObject *lst, CapState *cs, const char *what);
+/* A growable string buffer, for building the values of string and
+ * substitution captures. The buffer is itself a string object, which is
+ * resized in place and becomes the value once complete.
+ */
+typedef struct {
+    PyObject *str;
+    Py_ssize_t len;
+} StrBuf;
+
+static int strbuf_init (StrBuf *b, Py_ssize_t size) {
+    /* Never start empty - the empty string is shared, so cannot be resized */
+    b->str = PyString_FromStringAndSize(NULL, size < 16 ? 16 : size);
+    b->len = 0;
+    return (b->str == NULL) ? -1 : 0;
+}
+
+static int strbuf_add (StrBuf *b, const char *s, Py_ssize_t n) {
+    Py_ssize_t size = PyString_GET_SIZE(b->str);
+    if (b->len + n > size) {
+        size *= 2;
+        if (size < b->len + n)
+            size = b->len + n;
+        if (_PyString_Resize(&b->str, size) == -1)
+            return -1;
+    }
+    memcpy(PyString_AS_STRING(b->str) + b->len, s, n);
+    b->len += n;
+    return 0;
+}
+
+/* Return the completed string, passing ownership to the caller */
+static PyObject *strbuf_finish (StrBuf *b) {
+    PyObject *result;
+    if (_PyString_Resize(&b->str, b->len) == -1)
+        return NULL;
+    result = b->str;
+    b->str = NULL;
+    return result;
+}
+
+static int addonestring (StrBuf *b, CapState *cs, const char *what);
 
-static int stringcap(PyObject *lst, CapState *cs) {
+static int stringcap(StrBuf *b, CapState *cs) {
     StrAux cps[MAXSTRCAPS];
     int n;
     Py_ssize_t len, i;
@@ -1852,95 +3419,224 @@ static int stringcap(PyObject *lst, CapState *cs) {
     c = lua_tolstring(cs->L, subscache(cs), &len);
     */
     str = env2val(cs->patt, cs->cap->idx);
-    PyString_AsStringAndSize(str, &c, &len);
+    if (str == NULL)
+        return -1;
+    if (PyString_AsStringAndSize(str, &c, &len) == -1) {
+        Py_DECREF(str);
+        return -1;
+    }
     n = getstrcaps(cs, cps, 0) - 1;
     for (i = 0; i < len; i++) {
+        int rv;
         if (c[i] != '%' || c[++i] < '0' || c[i] > '9') {
             /* Add 1 char, c[i] */
-            str = PyString_FromStringAndSize(&c[i], 1);
-            PyList_Append(lst, str);
-            Py_DECREF(str);
+            rv = strbuf_add(b, &c[i], 1);
         }
         else {
             int l = c[i] - '0';
             if (l > n) {
                 PyErr_SetString(PyExc_ValueError, "Invalid capture index");
-                return -1;
+                rv = -1;
             }
             else if (cps[l].isstring) {
-                str = PyString_FromStringAndSize(cps[l].u.s.s, cps[l].u.s.e - cps[l].u.s.s);
-                PyList_Append(lst, str);
-                Py_DECREF(str);
+                rv = strbuf_add(b, cps[l].u.s.s, cps[l].u.s.e - cps[l].u.s.s);
             }
             else {
                 Capture *curr = cs->cap;
-                int rv;
                 cs->cap = cps[l].u.cp;
-                rv = addonestring(lst, cs, "capture");
-                if (rv != 1) {
-                    if (rv != -1)
-                        PyErr_SetString(PyExc_ValueError, "No values in capture index");
-                    return -1;
-                }
+                rv = addonestring(b, cs, "capture");
+                if (rv == 0)
+                    PyErr_SetString(PyExc_ValueError, "No values in capture index");
+                rv = (rv == 1) ? 0 : -1;
                 cs->cap = curr;
             }
         }
+        if (rv == -1) {
+            Py_DECREF(str);
+            return -1;
+        }
     }
+    Py_DECREF(str);
     return 0;
 }
 
-static int substcap(PyObject *lst, CapState *cs) {
-    const char *curr = cs->cap->s;
-    PyObject *str;
+static int substcap(StrBuf *b, CapState *cs) {
+    const char *curr = capaddr(cs, cs->cap);
     if (isfullcap(cs->cap)) {
         /* Keep original text */
-        str = PyString_FromStringAndSize(curr, cs->cap->siz - 1);
-        if (str == NULL) {
-            return -1;
-        }
-        if (PyList_Append(lst, str)) {
-            Py_DECREF(str);
+        if (strbuf_add(b, curr, cs->cap->siz - 1) == -1)
             return -1;
-        }
-        Py_DECREF(str);
     }
     else {
         cs->cap++;
         while (!isclosecap(cs->cap)) {
-            const char *next = cs->cap->s;
+            const char *next = capaddr(cs, cs->cap);
             int rv;
-            str = PyString_FromStringAndSize(curr, next - curr);
-            if (str == NULL) {
-                return -1;
-            }
-            if (PyList_Append(lst, str)) {
-                Py_DECREF(str);
+            if (strbuf_add(b, curr, next - curr) == -1)
                 return -1;
-            }
-            Py_DECREF(str);
-            rv = addonestring(lst, cs, "replacement");
+            rv = addonestring(b, cs, "replacement");
             if (rv == -1)
                 return -1;
             else if (rv == 0) /* No capture value? */
                 curr = next;
             else
-                curr = closeaddr(cs->cap - 1); /* Continue after match */
+                curr = closeaddr(cs, cs->cap - 1); /* Continue after match */
         }
-        str = PyString_FromStringAndSize(curr, cs->cap->s - curr); /* Add last piece of text */
-        if (str == NULL) {
+        /* Add last piece of text */
+        if (strbuf_add(b, curr, capaddr(cs, cs->cap) - curr) == -1)
             return -1;
+    }
+    cs->cap++; /* Go to next capture */
+    return 0;
+}
+
+/* Summarise the program of patt. The result is cached until the program is
+ * next resized.
+ */
+static int pattflags (PyObject *patt) {
+    if (!(patflags(patt) & PF_ANALYSED)) {
+        int flags = PF_ANALYSED;
+        Instruction *p;
+        for (p = patprog(patt); p->i.code != IEnd; p += sizei(p)) {
+            if (p->i.code == ICloseRunTime)
+                flags |= PF_RUNTIME;
+            else if (iscapture(p) && getkind(p) == Cbackref)
+                flags |= PF_BACKREF;
         }
-        if (PyList_Append(lst, str)) {
-            Py_DECREF(str);
+        patflags(patt) = flags;
+    }
+    return patflags(patt);
+}
+
+/* Map the env index of each group name and back reference in the program
+ * of patt to a canonical id - the index of the first equal name - so that
+ * names can be compared as integers. Other indexes map to 0. The result is
+ * cached until the program is next resized.
+ */
+static int *pattgroupids (PyObject *patt) {
+    Instruction *p;
+    PyObject *seen;
+    int *ids;
+    Py_ssize_t n;
+
+    if (patgroupids(patt))
+        return patgroupids(patt);
+    n = patenv(patt) ? PyList_GET_SIZE(patenv(patt)) + 1 : 1;
+    ids = PyMem_New(int, n);
+    if (ids == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(ids, 0, n * sizeof(int));
+    seen = PyDict_New();
+    if (seen == NULL) {
+        PyMem_Del(ids);
+        return NULL;
+    }
+    for (p = patprog(patt); p->i.code != IEnd; p += sizei(p)) {
+        int idx = p->i.offset;
+        PyObject *name;
+        PyObject *id;
+        if (!iscapture(p) || idx == 0 || idx >= n || ids[idx] != 0 ||
+                (getkind(p) != Cgroup && getkind(p) != Cbackref))
+            continue;
+        name = env2val(patt, idx);
+        if (name == NULL)
+            goto err;
+        id = PyDict_GetItem(seen, name);
+        if (id)
+            ids[idx] = PyInt_AS_LONG(id);
+        else {
+            ids[idx] = idx;
+            id = PyInt_FromLong(idx);
+            if (id == NULL || PyDict_SetItem(seen, name, id) == -1) {
+                Py_XDECREF(id);
+                Py_DECREF(name);
+                /* Unhashable names only match themselves */
+                if (!PyErr_ExceptionMatches(PyExc_TypeError))
+                    goto err;
+                PyErr_Clear();
+                continue;
+            }
+            Py_DECREF(id);
+        }
+        Py_DECREF(name);
+    }
+    Py_DECREF(seen);
+    patgroupids(patt) = ids;
+    ((Pattern *)patt)->ngroupids = n;
+    return ids;
+
+err:
+    Py_DECREF(seen);
+    PyMem_Del(ids);
+    return NULL;
+}
+
+/* Canonical id of the group name at env index idx, or 0 if it is unknown */
+static int groupid (PyObject *patt, int idx) {
+    if (patgroupids(patt) == NULL || idx >= ((Pattern *)patt)->ngroupids)
+        return 0;
+    return patgroupids(patt)[idx];
+}
+
+/* The most positional arguments fn can take, or -1 if there is no limit
+ * or it cannot be determined.
+ */
+static int callbackarity (PyObject *fn) {
+    int bound = 0;
+    if (PyMethod_Check(fn)) {
+        bound = PyMethod_GET_SELF(fn) != NULL;
+        fn = PyMethod_GET_FUNCTION(fn);
+    }
+    if (PyFunction_Check(fn)) {
+        PyCodeObject *co = (PyCodeObject *)PyFunction_GET_CODE(fn);
+        if (co->co_flags & CO_VARARGS)
             return -1;
+        return co->co_argcount > bound ? co->co_argcount - bound : 0;
+    }
+    if (PyCFunction_Check(fn)) {
+        switch (PyCFunction_GET_FLAGS(fn) &
+                ~(METH_CLASS | METH_STATIC | METH_COEXIST)) {
+            case METH_NOARGS: return 0;
+            case METH_O: return 1;
         }
-        Py_DECREF(str);
     }
-    cs->cap++; /* Go to next capture */
-    return 0;
+    return -1;
+}
+
+/* Map the env index of each function and match-time capture in the
+ * program of patt to the arity of its function (see callbackarity), so
+ * that values the function cannot take are never built. Other indexes map
+ * to -1. The result is cached until the program is next resized.
+ */
+static int *pattarities (PyObject *patt) {
+    Instruction *p;
+    int *arities;
+    Py_ssize_t n;
+
+    if (patarities(patt))
+        return patarities(patt);
+    n = patenv(patt) ? PyList_GET_SIZE(patenv(patt)) + 1 : 1;
+    arities = PyMem_New(int, n);
+    if (arities == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(arities, -1, n * sizeof(int));
+    for (p = patprog(patt); p->i.code != IEnd; p += sizei(p)) {
+        int idx = p->i.offset;
+        if (iscapture(p) && idx > 0 && idx < n &&
+                (getkind(p) == Cfunction || getkind(p) == Cruntime))
+            arities[idx] = callbackarity(PyList_GET_ITEM(patenv(patt), idx - 1));
+    }
+    patarities(patt) = arities;
+    ((Pattern *)patt)->narities = n;
+    return arities;
 }
 
 static Capture *findback (CapState *cs, Capture *cap, PyObject *id) {
+    int gid = groupid(cs->patt, cap->idx);
     for (;;) {
         if (cap == cs->ocap) {  /* not found */
             PyObject *repr = PyObject_Repr(id);
@@ -1959,7 +3655,12 @@ static Capture *findback (CapState *cs, Capture *cap, PyObject *id) {
             cap = findopen(cap);
         else if (!isfullcap(cap))
             continue; /* opening an enclosing capture: skip and get previous */
-        if (captype(cap) == Cgroup) {
+        if (captype(cap) == Cgroup && gid != 0 &&
+                groupid(cs->patt, cap->idx) != 0) {
+            if (gid == groupid(cs->patt, cap->idx))  /* right group? */
+                return cap;
+        }
+        else if (captype(cap) == Cgroup) {
             PyObject *grpid = env2val(cs->patt, cap->idx);
             int cmp;
             if (grpid == NULL && PyErr_Occurred())
@@ -1968,6 +3669,7 @@ static Capture *findback (CapState *cs, Capture *cap, PyObject *id) {
                 Py_DECREF(grpid);
                 return NULL;
             }
+            Py_XDECREF(grpid);
             if (cmp == 0) {  /* right group? */
                 return cap;
             }
@@ -1978,10 +3680,18 @@ static Capture *findback (CapState *cs, Capture *cap, PyObject *id) {
 static int backrefcap (CapState *cs) {
     int n;
     Capture *curr = cs->cap;
-    PyObject *id = env2val(cs->patt, cs->cap->idx);
+    PyObject *id;
+    if (cs->backrefs && cs->backrefs[curr - cs->ocap]) {
+        cs->cap = cs->backrefs[curr - cs->ocap];
+        n = pushallvalues(cs, 0);
+        cs->cap = curr + 1;
+        return n;
+    }
+    id = env2val(cs->patt, cs->cap->idx);
     if (id == NULL && PyErr_Occurred())
         return -1;
     cs->cap = findback(cs, curr, id);
+    Py_XDECREF(id);
     if (cs->cap == NULL) {
         /* Restore old value and return an error */
         cs->cap = curr;
@@ -1992,6 +3702,51 @@ static int backrefcap (CapState *cs) {
     return n;
 }
 
+/* Node capture: a (name, start, end, children) tuple, where children is a
+ * list of the values of the nested captures.
+ */
+static int nodecap (CapState *cs) {
+    Capture *open = cs->cap;
+    Py_ssize_t base = PyList_GET_SIZE(cs->values);
+    Py_ssize_t end;
+    PyObject *name;
+    PyObject *children;
+    PyObject *node;
+
+    if (isfullcap(cs->cap++))
+        end = closeoff(open);
+    else {
+        while (!isclosecap(cs->cap)) {
+            if (pushcapture(cs) == -1)
+                return -1;
+        }
+        end = (cs->cap++)->off;
+    }
+    children = PyList_GetSlice(cs->values, base, PyList_GET_SIZE(cs->values));
+    if (children == NULL)
+        return -1;
+    if (PyList_SetSlice(cs->values, base, PyList_GET_SIZE(cs->values),
+                        NULL) == -1) {
+        Py_DECREF(children);
+        return -1;
+    }
+    name = env2val(cs->patt, open->idx);
+    if (name == NULL) {
+        Py_DECREF(children);
+        return -1;
+    }
+    node = Py_BuildValue("(NnnN)", name, (Py_ssize_t)open->off, end,
+                         children);
+    if (node == NULL)
+        return -1;
+    if (PyList_Append(cs->values, node) == -1) {
+        Py_DECREF(node);
+        return -1;
+    }
+    Py_DECREF(node);
+    return 1;
+}
+
 static int tablecap (CapState *cs) {
     int n = 0;
     PyObject *result = PyList_New(0);
@@ -2023,8 +3778,14 @@ static int tablecap (CapState *cs) {
         else {
 #endif
             int k = pushcapture(cs);
-            Py_ssize_t values_len = PySequence_Size(cs->values);
-            PyObject *slice = PySequence_GetSlice(cs->values, -k, values_len);
+            Py_ssize_t values_len;
+            PyObject *slice;
+            if (k == -1) {
+                Py_DECREF(result);
+                return -1;
+            }
+            values_len = PySequence_Size(cs->values);
+            slice = PySequence_GetSlice(cs->values, -k, values_len);
             if (slice == NULL) {
                 Py_DECREF(result);
                 return -1;
@@ -2050,6 +3811,85 @@ static int tablecap (CapState *cs) {
     return 1;
 }
 
+/* Convert the text of the capture directly from the subject. Nested
+ * captures are skipped.
+ */
+static int convertcap (CapState *cs) {
+    const char *s = capaddr(cs, cs->cap);
+    Py_ssize_t len;
+    PyObject *conv = env2val(cs->patt, cs->cap->idx);
+    PyObject *arg;
+    PyObject *val = NULL;
+    char buf[64];
+    char *str = buf;
+
+    if (conv == NULL)
+        return -1;
+    if (isfullcap(cs->cap))
+        len = cs->cap->siz - 1;
+    else
+        len = capaddr(cs, nextcap(cs->cap) - 1) - s;
+    cs->cap = nextcap(cs->cap);
+    arg = PyTuple_GET_ITEM(conv, 1);
+
+    switch (PyInt_AS_LONG(PyTuple_GET_ITEM(conv, 0))) {
+        case CONV_DECODE:
+            val = PyUnicode_Decode(s, len, PyString_AS_STRING(arg), "strict");
+            break;
+        case CONV_INT: case CONV_FLOAT: {
+            /* The number parsers need a NUL terminated string */
+            if (memchr(s, '\0', len)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "null byte in numeric capture");
+                break;
+            }
+            if (len >= (Py_ssize_t)sizeof(buf) &&
+                    (str = PyMem_Malloc(len + 1)) == NULL) {
+                PyErr_NoMemory();
+                break;
+            }
+            memcpy(str, s, len);
+            str[len] = '\0';
+            if (PyInt_AS_LONG(PyTuple_GET_ITEM(conv, 0)) == CONV_INT) {
+                /* PyInt_FromString skips whitespace around the number */
+                char *end = NULL;
+                if (len > 0 && !Py_ISSPACE(str[0]) && !Py_ISSPACE(str[len - 1]))
+                    val = PyInt_FromString(str, &end, PyInt_AS_LONG(arg));
+                if (val != NULL && end != str + len)
+                    Py_CLEAR(val);
+                if (val == NULL && !PyErr_Occurred())
+                    PyErr_Format(PyExc_ValueError,
+                                 "invalid literal for int(): %.200s", str);
+            }
+            else {
+                char *end;
+                double d = PyOS_string_to_double(str, &end, NULL);
+                if (d == -1.0 && PyErr_Occurred())
+                    ;
+                else if (end != str + len || len == 0)
+                    PyErr_Format(PyExc_ValueError,
+                                 "invalid literal for float(): %.200s", str);
+                else
+                    val = PyFloat_FromDouble(d);
+            }
+            if (str != buf)
+                PyMem_Free(str);
+            break;
+        }
+        default:
+            PyErr_SetString(PyExc_RuntimeError, "Unknown conversion capture");
+    }
+    Py_DECREF(conv);
+    if (val == NULL)
+        return -1;
+    if (PyList_Append(cs->values, val) == -1) {
+        Py_DECREF(val);
+        return -1;
+    }
+    Py_DECREF(val);
+    return 1;
+}
+
 static int querycap (CapState *cs) {
     int n;
     /* Copy this here, as pushallvalues changes cs->cap */
@@ -2097,11 +3937,112 @@ static int querycap (CapState *cs) {
     return 1;
 }
 
-static int functioncap (CapState *cs) {
+/* Call fn with first (if not NULL) followed by the n values starting at
+ * values[base]. Builtins taking a single argument or none are called
+ * directly. Otherwise the arguments are put in a tuple; if argsp is not
+ * NULL, the tuple is kept there and reused by later calls of the same
+ * size once nothing else refers to it.
+ */
+static PyObject *callvalues (PyObject *fn, PyObject *first,
+                             PyObject *values, Py_ssize_t base, Py_ssize_t n,
+                             PyObject **argsp) {
+    Py_ssize_t nargs = n + (first != NULL);
+    Py_ssize_t i;
+    PyObject *args;
+    PyObject *result;
+    if (PyCFunction_Check(fn)) {
+        int flags = PyCFunction_GET_FLAGS(fn) &
+                    ~(METH_CLASS | METH_STATIC | METH_COEXIST);
+        if ((flags == METH_O && nargs == 1) ||
+                (flags == METH_NOARGS && nargs == 0)) {
+            PyObject *arg = NULL;
+            if (nargs == 1)
+                arg = first ? first : PyList_GET_ITEM(values, base);
+            return (*PyCFunction_GET_FUNCTION(fn))(PyCFunction_GET_SELF(fn), arg);
+        }
+    }
+    args = argsp ? *argsp : NULL;
+    if (args && Py_REFCNT(args) == 1 && PyTuple_GET_SIZE(args) == nargs) {
+        Py_INCREF(args);
+        for (i = 0; i < nargs; ++i) {
+            PyObject *old = PyTuple_GET_ITEM(args, i);
+            PyTuple_SET_ITEM(args, i, NULL);
+            Py_XDECREF(old);
+        }
+    }
+    else {
+        args = PyTuple_New(nargs);
+        if (args == NULL)
+            return NULL;
+        if (argsp) {
+            Py_XDECREF(*argsp);
+            *argsp = args;
+            Py_INCREF(args);
+        }
+    }
+    i = 0;
+    if (first) {
+        Py_INCREF(first);
+        PyTuple_SET_ITEM(args, i++, first);
+    }
+    for (; i < nargs; ++i) {
+        PyObject *val = PyList_GET_ITEM(values, base++);
+        Py_INCREF(val);
+        PyTuple_SET_ITEM(args, i, val);
+    }
+    result = PyObject_Call(fn, args, NULL);
+    Py_DECREF(args);
+    return result;
+}
+
+/* Like pushallvalues (without the extra value), but push at most limit
+ * values. Nested captures past the limit are skipped without being built.
+ */
+static int pushsomevalues (CapState *cs, int limit) {
+    Capture *co = cs->cap;
+    Py_ssize_t base = PyList_GET_SIZE(cs->values);
+    int n = 0;
+    if (limit == 0) {
+        cs->cap = nextcap(co);
+        return 0;
+    }
+    if (isfullcap(cs->cap) || isclosecap(cs->cap + 1))
+        return pushallvalues(cs, 0);
+    cs->cap++;
+    while (!isclosecap(cs->cap)) {
+        int k;
+        if (n >= limit) {
+            cs->cap = nextcap(cs->cap);
+            continue;
+        }
+        k = pushcapture(cs);
+        if (k == -1)
+            return -1;
+        n += k;
+    }
+    if (n == 0) {
+        int asspan = captype(co) == Cspan ||
+                     (cs->spans && captype(co) == Csimple);
+        if (pushsubject(cs, capaddr(cs, co), capaddr(cs, cs->cap), asspan) == -1)
+            return -1;
+        n = 1;
+    }
+    else if (n > limit) {
+        if (PyList_SetSlice(cs->values, base + limit,
+                            PyList_GET_SIZE(cs->values), NULL) == -1)
+            return -1;
+        n = limit;
+    }
+    cs->cap++;
+    return n;
+}
+
+static int functioncap (CapState *cs) {
     int n;
     int capidx = cs->cap->idx;
-    PyObject *temp = cs->values;
-    PyObject *captures;
+    int *arities;
+    Py_ssize_t base = PyList_GET_SIZE(cs->values);
+    PyObject *result;
     PyObject *fn;
     fn = env2val(cs->patt, capidx);
     if (fn == NULL && PyErr_Occurred())
@@ -2110,38 +4051,43 @@ static int functioncap (CapState *cs) {
         PyErr_SetString(PyExc_RuntimeError, "No function for function capture");
         return -1;
     }
-    captures = PyList_New(0);
-    if (captures == NULL) {
+    arities = pattarities(cs->patt);
+    if (arities == NULL) {
         Py_DECREF(fn);
         return -1;
     }
-    cs->values = captures;
-    n = pushallvalues(cs, 0);
-    cs->values = temp;
-    temp = PyObject_CallFunctionObjArgs((PyObject*)&PyTuple_Type, captures, NULL);
-    if (temp == NULL) {
-        Py_DECREF(captures);
+    /* Push the values onto our own list, and pass them from there */
+    if (arities[capidx] == -1)
+        n = pushallvalues(cs, 0);
+    else
+        n = pushsomevalues(cs, arities[capidx]);
+    if (n == -1) {
         Py_DECREF(fn);
         return -1;
     }
-    Py_DECREF(captures);
-    captures = temp;
-    temp = PyObject_CallObject(fn, captures);
-    Py_DECREF(captures);
+    result = callvalues(fn, NULL, cs->values, base, n, NULL);
     Py_DECREF(fn);
-    if (temp == NULL)
+    if (result == NULL)
         return -1;
-    if (PyList_Append(cs->values, temp) == -1) {
-        Py_DECREF(temp);
+    if (PyList_SetSlice(cs->values, base, PyList_GET_SIZE(cs->values), NULL) == -1 ||
+            PyList_Append(cs->values, result) == -1) {
+        Py_DECREF(result);
         return -1;
     }
-    Py_DECREF(temp);
+    Py_DECREF(result);
     return 1;
 }
 
+/* Fold capture: the accumulator starts as the first value of the first
+ * nested capture, and each following capture calls fn(accum, value) with
+ * its first value, or fn(accum) if it has none.
+ */
 static int foldcap (CapState *cs) {
     int idx = cs->cap->idx;
-    PyObject *accum;
+    Py_ssize_t base = PyList_GET_SIZE(cs->values);
+    PyObject *accum = NULL;
+    PyObject *args = NULL;
+    int n = 0;
     PyObject *fn = env2val(cs->patt, idx);
     if (fn == NULL && PyErr_Occurred())
         return -1;
@@ -2149,22 +4095,31 @@ static int foldcap (CapState *cs) {
         PyErr_SetString(PyExc_RuntimeError, "No function for fold capture");
         return -1;
     }
-    if (isfullcap(cs->cap++) || isclosecap(cs->cap) || (accum = getonecapture(cs)) == NULL) {
-        if (!PyErr_Occurred())
+    if (isfullcap(cs->cap++) || isclosecap(cs->cap) ||
+            (n = pushcapture(cs)) <= 0) {
+        if (n == 0)
             PyErr_SetString(PyExc_RuntimeError, "No initial value for fold capture");
-        Py_DECREF(fn);
-        return -1;
+        goto err;
     }
+    /* Keep only the first value */
+    accum = PyList_GET_ITEM(cs->values, base);
+    Py_INCREF(accum);
+    if (PyList_SetSlice(cs->values, base, PyList_GET_SIZE(cs->values), NULL) == -1)
+        goto err;
     while (!isclosecap(cs->cap)) {
-        PyObject *val = getonecapture(cs);
-        accum = PyObject_CallFunctionObjArgs(fn, accum, val, NULL);
-        Py_DECREF(val);
-        if (accum == NULL) {
-            Py_DECREF(fn);
-            return -1;
-        }
+        PyObject *result;
+        n = pushcapture(cs);
+        if (n == -1)
+            goto err;
+        result = callvalues(fn, accum, cs->values, base, n > 1 ? 1 : n, &args);
+        Py_DECREF(accum);
+        accum = result;
+        if (accum == NULL ||
+                PyList_SetSlice(cs->values, base, PyList_GET_SIZE(cs->values), NULL) == -1)
+            goto err;
     }
     cs->cap++;  /* skip close entry */
+    Py_XDECREF(args);
     Py_DECREF(fn);
     if (PyList_Append(cs->values, accum) == -1) {
         Py_DECREF(accum);
@@ -2172,124 +4127,143 @@ static int foldcap (CapState *cs) {
     }
     Py_DECREF(accum);
     return 1;
+
+err:
+    Py_XDECREF(accum);
+    Py_XDECREF(args);
+    Py_DECREF(fn);
+    return -1;
 }
 
+/* Call the function of the match-time capture closed by close as
+ * fn(subject, position, values). The subject is the object being matched
+ * (the first match argument), not a copy. A function taking only two
+ * arguments is called as fn(subject, position), and the nested captures
+ * are never built.
+ */
 static int runtimecap (Capture *close, Capture *ocap,
                        const char *o, const char *s,
                        PyObject *patt, PyObject *args,
                        PyObject **ret) {
     CapState cs;
     int n;
+    int *arities;
     PyObject *fn;
     Capture *open = findopen(close);
-    PyObject *result = PyList_New(0);
+    PyObject *values = NULL;
+    PyObject *pos;
     PyObject *temp;
     *ret = NULL;
-    if (result == NULL)
-        return -1;
     if (captype(open) != Cruntime) {
       PyErr_SetString(PyExc_RuntimeError, "Capture type is not runtime capture");
       return -1;
     }
     fn = env2val(patt, open->idx);
     if (fn == NULL) {
-        Py_DECREF(result);
         if (!PyErr_Occurred())
             PyErr_SetString(PyExc_RuntimeError, "No function for runtime capture");
         return -1;
     }
+    arities = pattarities(patt);
+    if (arities == NULL) {
+        Py_DECREF(fn);
+        return -1;
+    }
     close->kind = Cclose;
-    close->s = s;
-    cs.ocap = ocap; cs.cap = open;
-    cs.values = result;
-    cs.s = o;
-    cs.args = args;
-    cs.patt = patt;
-#if 0 /* What is this for? */
-    pushluaval(&cs);
-#endif
-    n = pushallvalues(&cs, 0);
-    temp = PyObject_CallFunctionObjArgs((PyObject*)&PyTuple_Type, result, NULL);
-    Py_DECREF(result);
-    if (temp == NULL) {
+    close->off = s - o;
+    if (arities[open->idx] != 2) {
+        PyObject *list = PyList_New(0);
+        if (list == NULL) {
+            Py_DECREF(fn);
+            return -1;
+        }
+        cs.ocap = ocap; cs.cap = open;
+        cs.values = list;
+        cs.s = o;
+        cs.args = args;
+        cs.patt = patt;
+        cs.spans = 0;
+        cs.backrefs = NULL;
+        n = pushallvalues(&cs, 0);
+        values = n == -1 ? NULL : PyList_AsTuple(list);
+        Py_DECREF(list);
+        if (values == NULL) {
+            Py_DECREF(fn);
+            return -1;
+        }
+    }
+    pos = PyInt_FromSsize_t(s - o);
+    if (pos == NULL) {
+        Py_XDECREF(values);
         Py_DECREF(fn);
         return -1;
     }
-    result = temp;
-    temp = PyObject_CallFunction(fn, "siO", o, s-o, result);
-    Py_DECREF(result);
+    temp = PyObject_CallFunctionObjArgs(fn, PyTuple_GET_ITEM(args, 0), pos,
+                                        values, NULL);
+    Py_DECREF(pos);
+    Py_XDECREF(values);
     Py_DECREF(fn);
     if (temp == NULL)
         return -1;
     *ret = temp;
     return close - open;
 }
-static int addonestring (PyObject *lst, CapState *cs, const char *what) {
+static int addonestring (StrBuf *b, CapState *cs, const char *what) {
     switch (captype(cs->cap)) {
         case Cstring:
             /* Add capture directly to buffer */
-            if (stringcap(lst, cs) == -1)
+            if (stringcap(b, cs) == -1)
                 return -1;
             return 1;
         case Csubst:
             /* Add capture directly to buffer */
-            if (substcap(lst, cs) == -1)
+            if (substcap(b, cs) == -1)
                 return -1;
             return 1;
+        case Csimple:
+            /* A simple capture's first value is its text */
+            if (isfullcap(cs->cap)) {
+                if (strbuf_add(b, capaddr(cs, cs->cap), cs->cap->siz - 1) == -1)
+                    return -1;
+                cs->cap++;
+                return 1;
+            }
+            /* FALLTHROUGH */
         default: {
-            /* TODO: using cs->values as temp storage! */
-#if 1 /* Less list hacking, but more temp value shuffling... */
+            /* Push the values, and keep only the first. Strings are
+             * always built from the subject text, not from spans.
+             */
+            Py_ssize_t base = PyList_GET_SIZE(cs->values);
+            int spans = cs->spans;
             int n;
-            PyObject *save = cs->values;
-            PyObject *temp = PyList_New(0);
-            if (temp == NULL)
-                return -1;
-            /* Only the first result */
-            cs->values = temp;
+            int rv;
+            cs->spans = 0;
             n = pushcapture(cs);
-            if (n == -1) {
-                Py_DECREF(temp);
+            cs->spans = spans;
+            if (n == -1)
                 return -1;
-            }
-            temp = cs->values;
-            cs->values = save;
             if (n > 0) {
-                PyObject *val = PySequence_GetItem(temp, 0);
-                Py_DECREF(temp);
-                if (val == NULL)
-                    return -1;
-                if (!PyString_Check(val)) {
+                PyObject *val = PyList_GET_ITEM(cs->values, base);
+                if (PyString_Check(val))
+                    rv = strbuf_add(b, PyString_AS_STRING(val),
+                                    PyString_GET_SIZE(val));
+                else {
                     /* Convert to string */
                     PyObject *s = PyObject_Str(val);
-                    Py_DECREF(val);
                     if (s == NULL)
                         return -1;
-                    val = s;
+                    rv = strbuf_add(b, PyString_AS_STRING(s),
+                                    PyString_GET_SIZE(s));
+                    Py_DECREF(s);
                 }
-                if (PyList_Append(lst, val) == -1) {
-                    Py_DECREF(val);
+                if (rv == -1)
+                    return -1;
+                /* Drop the results */
+                if (PyList_SetSlice(cs->values, base,
+                                    PyList_GET_SIZE(cs->values), NULL) == -1)
                     return -1;
-                }
-                Py_DECREF(val);
             }
             return n;
-#else
-            int n = pushcapture(cs);
-            Py_ssize_t len = PyList_Size(cs->values);
-            PyObject *val;
-            /* Only the first result */
-            val = PyList_GetItem(cs->values, len - n);
-            if (!PyString_Check(val)) {
-                /* Convert to string */
-                PyObject *s = PyObject_Str(val);
-                Py_DECREF(val);
-                val = s;
-            }
-            PyList_Append(lst, val);
-            /* Drop the results */
-            PyList_SetSlice(cs->values, len - n, len, NULL);
-            return n; /* ??? 1, surely? */
-#endif
         }
     }
 }
@@ -2297,7 +4271,7 @@ static int addonestring (PyObject *lst, CapState *cs, const char *what) {
 static int pushcapture (CapState *cs) {
     switch (captype(cs->cap)) {
         case Cposition: {
-            long pos = cs->cap->s - cs->s;
+            long pos = cs->cap->off;
             PyObject *val = PyInt_FromLong(pos);
             if (val == NULL)
                 return -1;
@@ -2332,7 +4306,7 @@ static int pushcapture (CapState *cs) {
             }
             return 1;
         }
-        case Csimple: {
+        case Csimple: case Cspan: {
             int k = pushallvalues(cs, 1);
             if (k == -1)
                 return -1;
@@ -2361,49 +4335,25 @@ static int pushcapture (CapState *cs) {
             }
             return n;
         }
-        case Cstring: {
-            PyObject *lst = PyList_New(0);
-            PyObject *str = PyString_FromString("");
-            PyObject *result;
-            stringcap(lst, cs);
-            result = PyObject_CallMethod(str, "join", "(O)", lst);
-            PyList_Append(cs->values, result);
-            Py_DECREF(result);
-            Py_DECREF(str);
-            Py_DECREF(lst);
-            return 1;
-        }
-        case Csubst: {
-            PyObject *lst = PyList_New(0);
-            if (lst == NULL) {
-                return -1;
-            }
-            PyObject *str = PyString_FromString("");
-            if (str == NULL) {
-                Py_DECREF(lst);
-                return -1;
-            }
+        case Cstring: case Csubst: {
+            StrBuf b;
             PyObject *result;
-            if (substcap(lst, cs) == -1) {
-                Py_DECREF(str);
-                Py_DECREF(lst);
+            int rv;
+            if (strbuf_init(&b, 64) == -1)
                 return -1;
-            }
-            result = PyObject_CallMethod(str, "join", "(O)", lst);
-            if (result == NULL) {
-                Py_DECREF(str);
-                Py_DECREF(lst);
+            if (captype(cs->cap) == Cstring)
+                rv = stringcap(&b, cs);
+            else
+                rv = substcap(&b, cs);
+            if (rv == -1 || (result = strbuf_finish(&b)) == NULL) {
+                Py_XDECREF(b.str);
                 return -1;
             }
-            if (PyList_Append(cs->values, result)) {
+            if (PyList_Append(cs->values, result) == -1) {
                 Py_DECREF(result);
-                Py_DECREF(str);
-                Py_DECREF(lst);
                 return -1;
             }
             Py_DECREF(result);
-            Py_DECREF(str);
-            Py_DECREF(lst);
             return 1;
         }
         case Cgroup: {
@@ -2418,9 +4368,11 @@ static int pushcapture (CapState *cs) {
         /* Table captures have different semantics, because tables in
          * Lua don't quite correspond to lists or dicts in Python.
          */
-        case Ctable: return tablecap(cs);
+        case Ctable:
+            return (cs->cap->idx == 0) ? tablecap(cs) : nodecap(cs);
         case Cfunction: return functioncap(cs);
         case Cquery: return querycap(cs);
+        case Cconvert: return convertcap(cs);
         case Cfold: return foldcap(cs);
         default: assert(0); return 0;
     }
@@ -2440,7 +4392,86 @@ static Capture *doublecap (Capture *cap, int captop) {
     return newc;
 }
 
-static PyObject *getcaptures (PyObject *patt, Capture **capturep, const char *s, const char *r, PyObject *args)
+/* Find the group capture each back reference refers to, in one pass over
+ * the captures. A group is visible to the captures after it, up to the end
+ * of its enclosing capture, so the latest visible group for each id is
+ * kept, with an undo log to restore the outer bindings at each close.
+ * Returns an array indexed by capture position (NULL entries for anything
+ * unresolved, which findback then reports), or NULL on error.
+ */
+static Capture **resolvebackrefs (PyObject *patt, Capture *ocap) {
+    typedef struct { int id; Capture *prev; } Undo;
+    typedef struct { Py_ssize_t mark; Capture *open; } Scope;
+    int *ids = pattgroupids(patt);
+    Py_ssize_t nids = ((Pattern *)patt)->ngroupids;
+    Capture **result = NULL;
+    Capture **latest = NULL;
+    Undo *undo = NULL;
+    Scope *scope = NULL;
+    Py_ssize_t n, nundo = 0, depth = 0;
+    Capture *cap;
+
+    if (ids == NULL)
+        return NULL;
+    for (cap = ocap; depth > 0 || !isclosecap(cap); cap++) {
+        if (isclosecap(cap))
+            depth--;
+        else if (!isfullcap(cap))
+            depth++;
+    }
+    n = cap - ocap;
+    result = PyMem_New(Capture *, n + 1);
+    latest = PyMem_New(Capture *, nids);
+    undo = PyMem_New(Undo, n + 1);
+    scope = PyMem_New(Scope, n + 1);
+    if (result == NULL || latest == NULL || undo == NULL || scope == NULL) {
+        PyErr_NoMemory();
+        PyMem_Del(result);
+        result = NULL;
+        goto done;
+    }
+    memset(result, 0, (n + 1) * sizeof(Capture *));
+    memset(latest, 0, nids * sizeof(Capture *));
+
+    for (cap = ocap; depth > 0 || !isclosecap(cap); cap++) {
+        Capture *group = NULL;
+        if (isclosecap(cap)) {
+            Scope *sc = &scope[--depth];
+            while (nundo > sc->mark) {
+                nundo--;
+                latest[undo[nundo].id] = undo[nundo].prev;
+            }
+            group = sc->open;
+        }
+        else if (captype(cap) == Cbackref) {
+            int id = groupid(patt, cap->idx);
+            if (id != 0)
+                result[cap - ocap] = latest[id];
+        }
+        else if (!isfullcap(cap)) {
+            scope[depth].mark = nundo;
+            scope[depth++].open = cap;
+        }
+        else
+            group = cap;
+        if (group && captype(group) == Cgroup) {
+            int id = groupid(patt, group->idx);
+            if (id != 0) {
+                undo[nundo].id = id;
+                undo[nundo++].prev = latest[id];
+                latest[id] = group;
+            }
+        }
+    }
+
+done:
+    PyMem_Del(latest);
+    PyMem_Del(undo);
+    PyMem_Del(scope);
+    return result;
+}
+
+static PyObject *getcaptures (PyObject *patt, Capture **capturep, const char *s, const char *r, PyObject *args, int spans)
 {
     Capture *capture = *capturep;
     int n = 0;
@@ -2455,14 +4486,23 @@ static PyObject *getcaptures (PyObject *patt, Capture **capturep, const char *s,
         cs.s = s;
         cs.args = args;
         cs.patt = patt;
+        cs.spans = spans;
+        cs.backrefs = NULL;
+        if ((pattflags(patt) & PF_BACKREF) &&
+                (cs.backrefs = resolvebackrefs(patt, capture)) == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
         do { /* collect the values */
             int count = pushcapture(&cs);
             if (count == -1) {
+                PyMem_Del(cs.backrefs);
                 Py_DECREF(result);
                 return NULL;
             }
             n += count;
         } while (!isclosecap(cs.cap));
+        PyMem_Del(cs.backrefs);
     }
     return result;
 }
@@ -2471,8 +4511,13 @@ static PyObject *getcaptures (PyObject *patt, Capture **capturep, const char *s,
  * Finally, the matcher
  * **********************************************************************
  */
+/* If nocapture is set, capture instructions are skipped rather than
+ * recorded, and *capturep may be NULL. This is only valid for programs
+ * without match-time captures, which need the nested captures to run.
+ */
 static const char *match (const char *o, const char *s, const char *e,
-                          PyObject *patt, Capture **capturep, PyObject *args) {
+                          PyObject *patt, Capture **capturep, PyObject *args,
+                          int nocapture) {
     Stack stackbase[MAXBACK];
     Stack *stacklimit = stackbase + MAXBACK;
     Stack *stack = stackbase;  /* point to first empty slot in stack */
@@ -2481,6 +4526,10 @@ static const char *match (const char *o, const char *s, const char *e,
     const Instruction *op = patprog(patt);
     const Instruction *p = op;
     Capture *capture = *capturep;
+    if (!nocapture && e - o > MAXCAPOFF) {
+        PyErr_SetString(PyExc_ValueError, "Subject too long for captures");
+        return NULL;
+    }
     stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
 #ifdef TRACE
     Py_XDECREF(((Pattern*)patt)->trace);
@@ -2505,8 +4554,10 @@ static const char *match (const char *o, const char *s, const char *e,
                   PyErr_SetString(PyExc_RuntimeError, "Pattern end with unbalanced stack");
                   return NULL;
                 }
+                if (nocapture)
+                    return s;
                 capture[captop].kind = Cclose;
-                capture[captop].s = NULL;
+                capture[captop].siz = 0;
                 return s;
             }
             case IGiveup: {
@@ -2555,6 +4606,10 @@ static const char *match (const char *o, const char *s, const char *e,
             case IFunc: {
                 const char *r = (p+1)->f((p+2)->buff, o, s, e);
                 if (r == NULL) goto fail;
+                if (r < s || r > e) {
+                    PyErr_SetString(PyExc_RuntimeError, "Invalid position returned by native function");
+                    return NULL;
+                }
                 s = r;
                 p += p->i.offset;
                 continue;
@@ -2563,6 +4618,18 @@ static const char *match (const char *o, const char *s, const char *e,
                 p += p->i.offset;
                 continue;
             }
+            case IDispatch: {
+                int k = (s < e) ? (p+1)->buff[(byte)*s] : 0;
+                p += dispatchtarget(p, k);
+                continue;
+            }
+            case ITrie: {
+                const char *r = triematch(p, s, e);
+                if (r == NULL) goto fail;
+                s = r;
+                p += p->i.offset;
+                continue;
+            }
             case IChoice: {
                 if (stack >= stacklimit) {
                   PyErr_SetString(PyExc_RuntimeError, "Too many pending calls/choices");
@@ -2637,20 +4704,30 @@ static const char *match (const char *o, const char *s, const char *e,
             case ICloseRunTime: {
                 int fr = PyList_Size(patenv(patt));
                 PyObject *result;
-                PyObject *extravalues = NULL;
                 long res;
                 Py_ssize_t n = 0;
                 int ncap = runtimecap(capture + captop, capture, o, s, patt, args, &result);
                 if (ncap == -1 || result == NULL)
                     return NULL;
-                if (PySequence_Check(result)) {
-                    PyObject *rtresult = PySequence_ITEM(result, 0);
-                    extravalues = PySequence_ITEM(result, 1);
+                /* A (position, values) sequence adds dynamic captures */
+                if (!PyInt_Check(result) && result != Py_None &&
+                        PySequence_Check(result)) {
+                    PyObject *rtresult = PySequence_GetItem(result, 0);
+                    PyObject *extravalues = rtresult ? PySequence_GetItem(result, 1) : NULL;
                     Py_DECREF(result);
+                    if (extravalues == NULL) {
+                        Py_XDECREF(rtresult);
+                        return NULL;
+                    }
                     result = rtresult;
                     for (n = 0; n < PySequence_Size(extravalues); n++) {
-                        PyObject *val = PySequence_ITEM(extravalues, n);
-                        Py_ssize_t len = val2env(patt, val);
+                        PyObject *val = PySequence_GetItem(extravalues, n);
+                        if (val == NULL || val2env(patt, val) == ENV_ERROR) {
+                            Py_XDECREF(val);
+                            Py_DECREF(extravalues);
+                            Py_DECREF(result);
+                            return NULL;
+                        }
                         Py_DECREF(val);
                     }
                     Py_DECREF(extravalues);
@@ -2659,11 +4736,14 @@ static const char *match (const char *o, const char *s, const char *e,
                     Py_DECREF(result);
                     goto fail;
                 }
-                else if (result == Py_True) {
+                else if (result == Py_True)
                     res = s - o;  /* keep current position */
-                }
-                else if (PyInt_Check(result)) {
+                else if (PyInt_Check(result) || PyLong_Check(result))
                     res = PyInt_AsLong(result);
+                else {
+                    Py_DECREF(result);
+                    PyErr_SetString(PyExc_TypeError, "Match-time capture must return a position, bool or None");
+                    return NULL;
                 }
                 Py_DECREF(result);
                 if (res == -1 && PyErr_Occurred())
@@ -2683,20 +4763,23 @@ static const char *match (const char *o, const char *s, const char *e,
                         capsize = 2 * captop;
                     }
                     // FIXME Why is it fr+1, not fr like in lpeg.c?
-                    adddyncaptures(s, capture + captop - n - 1, n, fr+1);
+                    adddyncaptures(s - o, capture + captop - n - 1, n, fr+1);
                 }
                 p++;
                 continue;
             }
             case ICloseCapture: {
                 const char *s1 = s - getoff(p);
+                if (nocapture) {
+                    p++;
+                    continue;
+                }
                 if (captop <= 0) {
                     PyErr_SetString(PyExc_RuntimeError, "Close capture with no pending captures");
                     return NULL;
                 }
-                if (capture[captop - 1].siz == 0 &&
-                        s1 - capture[captop - 1].s < UCHAR_MAX) {
-                    capture[captop - 1].siz = s1 - capture[captop - 1].s + 1;
+                if (capture[captop - 1].siz == 0) {
+                    capture[captop - 1].siz = (s1 - o) - capture[captop - 1].off + 1;
                     p++;
                     continue;
                 }
@@ -2706,15 +4789,21 @@ static const char *match (const char *o, const char *s, const char *e,
                 }
             }
             case IEmptyCapture: case IEmptyCaptureIdx:
+                if (nocapture)
+                    goto skipcapture;
                 capture[captop].siz = 1;  /* mark entry as closed */
                 goto capture;
             case IOpenCapture:
+                if (nocapture)
+                    goto skipcapture;
                 capture[captop].siz = 0;  /* mark entry as open */
                 goto capture;
             case IFullCapture:
+                if (nocapture)
+                    goto skipcapture;
                 capture[captop].siz = getoff(p) + 1;  /* save capture size */
             capture: {
-                capture[captop].s = s - getoff(p);
+                capture[captop].off = (s - o) - getoff(p);
                 capture[captop].idx = p->i.offset;
                 capture[captop].kind = getkind(p);
                 if (++captop >= capsize) {
@@ -2724,6 +4813,7 @@ static const char *match (const char *o, const char *s, const char *e,
                     *capturep = capture;
                     capsize = 2 * captop;
                 }
+            skipcapture:
                 p++;
                 continue;
             }
@@ -2737,15 +4827,45 @@ static const char *match (const char *o, const char *s, const char *e,
         }
     }
 }
+/* Raise TypeError, as PyArg_ParseTupleAndKeywords would, if kw has a
+ * keyword argument which is not in kwlist.
+ */
+static int checkkeywords(PyObject *kw, char **kwlist) {
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    if (kw == NULL)
+        return 0;
+    while (PyDict_Next(kw, &pos, &key, &value)) {
+        char **k;
+        if (!PyString_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "keywords must be strings");
+            return -1;
+        }
+        for (k = kwlist; *k != NULL; ++k) {
+            if (strcmp(PyString_AS_STRING(key), *k) == 0)
+                break;
+        }
+        if (*k == NULL) {
+            PyErr_Format(PyExc_TypeError,
+                         "'%.200s' is an invalid keyword argument for this function",
+                         PyString_AS_STRING(key));
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static PyObject *
 Pattern_call(PyObject *self, PyObject *args, PyObject *kw)
 {
+    static char *kwlist[] = {"spans", NULL};
     char *str;
     Py_ssize_t len;
     Capture *cc;
     const char *e;
     PyObject *result;
     Match *res;
+    int spans = 0;
 
 #if 0
     if (!PyArg_ParseTuple(args, "s#", &str, &len))
@@ -2754,15 +4874,28 @@ Pattern_call(PyObject *self, PyObject *args, PyObject *kw)
     PyObject *target = PyTuple_GetItem(args, 0);
     if (target == NULL || PyString_AsStringAndSize(target, &str, &len) == -1)
         return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
 #endif
+    if (checkkeywords(kw, kwlist) == -1)
+        return NULL;
+    if (kw) {
+        PyObject *val = PyDict_GetItemString(kw, "spans");
+        if (val && (spans = PyObject_IsTrue(val)) == -1)
+            return NULL;
+    }
 
-    result = PyObject_CallFunction(match_cls, "");
-    if (result == NULL)
+    res = new_match();
+    if (res == NULL)
         return NULL;
+    result = (PyObject *)res;
 
     cc = malloc(IMAXCAPTURES * sizeof(Capture));
-    res = (Match *)result;
-    e = match(str, str, str + len, self, &cc, args);
+    if (cc == NULL) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    e = match(str, str, str + len, self, &cc, args, 0);
     if (e == 0) {
         free(cc);
         if (PyErr_Occurred()) {
@@ -2772,7 +4905,12 @@ Pattern_call(PyObject *self, PyObject *args, PyObject *kw)
         return result;
     }
     res->pos = e - str;
-    res->captures = getcaptures((PyObject*)self, &cc, str, e, args);
+    /* A match with no captures leaves captures NULL - see Match_captures */
+    if (isendcap(cc)) {
+        free(cc);
+        return result;
+    }
+    res->captures = getcaptures((PyObject*)self, &cc, str, e, args, spans);
     free(cc);
     if (res->captures == NULL) {
         Py_DECREF(result);
@@ -2781,85 +4919,1652 @@ Pattern_call(PyObject *self, PyObject *args, PyObject *kw)
     return result;
 }
 
-/* **********************************************************************
- * Module creation - type initialisation, method tables, etc
- * **********************************************************************
+/* Match without building captures. Returns the end position of the match,
+ * or -1 if there is no match.
  */
-#ifdef TRACE
-static PyMemberDef Pattern_members[] = {
-    {"trace", T_OBJECT, offsetof(Pattern, trace), READONLY},
-    {0}
-};
-#endif
+static PyObject *Pattern_test(PyObject *self, PyObject *args)
+{
+    char *str;
+    Py_ssize_t len;
+    Capture *cc = NULL;
+    const char *e;
+    int nocapture;
 
-static PyMethodDef Pattern_methods[] = {
-    {"dump", (PyCFunction)Pattern_dump, METH_NOARGS,
-     "Build a list representing the pattern, for debugging"
-    },
-    {"display", (PyCFunction)Pattern_display, METH_NOARGS,
-     "Print the pattern, for debugging"
-    },
-    {"_set_code", (PyCFunction)Pattern_set_code, METH_VARARGS,
-     "Set the code and environ for the pattern (internal use)"
-    },
-    {"env", (PyCFunction)Pattern_env, METH_NOARGS,
-     "The pattern environment, for debugging"
-    },
-    {"Any", (PyCFunction)Pattern_Any, METH_O | METH_CLASS,
-     "A pattern which matches any character(s)"
-    },
-    {"Match", (PyCFunction)Pattern_Match, METH_O | METH_CLASS,
-     "A pattern which matches a specific string"
-    },
-    {"Fail", (PyCFunction)Pattern_Fail, METH_NOARGS | METH_CLASS,
-     "A pattern which never matches"
-    },
-    {"Set", (PyCFunction)Pattern_Set, METH_O | METH_CLASS,
-     "A pattern which matches a set of character(s)"
-    },
-    {"Range", (PyCFunction)Pattern_Range, METH_O | METH_CLASS,
-     "A pattern which matches a set of character(s) given as ranges"
-    },
-    {"Cap", (PyCFunction)Pattern_Capture, METH_O | METH_CLASS,
-     "A simple capture"
-    },
-    {"CapT", (PyCFunction)Pattern_CaptureTab, METH_O | METH_CLASS,
-     "A table capture"
-    },
-    {"CapS", (PyCFunction)Pattern_CaptureSub, METH_O | METH_CLASS,
-     "A substitution capture"
-    },
-    {"CapP", (PyCFunction)Pattern_CapturePos, METH_NOARGS | METH_CLASS,
-     "A position capture"
-    },
-    {"CapA", (PyCFunction)Pattern_CaptureArg, METH_O | METH_CLASS,
-     "An argument capture"
-    },
-    {"CapC", (PyCFunction)Pattern_CaptureConst, METH_VARARGS | METH_CLASS,
-     "A constant capture"
-    },
-    {"CapB", (PyCFunction)Pattern_CaptureBack, METH_O | METH_CLASS,
-     "A back reference"
-    },
-    {"CapG", (PyCFunction)Pattern_CaptureGroup, METH_VARARGS | METH_CLASS,
-     "A group capture"
-    },
-    {"CapF", (PyCFunction)Pattern_CaptureFold, METH_VARARGS | METH_CLASS,
-     "A fold capture"
-    },
-    {"CapRT", (PyCFunction)Pattern_CaptureRuntime, METH_VARARGS | METH_CLASS,
-     "A runtime capture"
-    },
-    {"Var", (PyCFunction)Pattern_Var, METH_O | METH_CLASS,
-     "A grammar variable reference"
-    },
-    {"Grammar", (PyCFunction)Pattern_Grammar,
-     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
-     "A grammar"
-    },
-    {"Dummy", (PyCFunction)Pattern_Dummy, METH_NOARGS | METH_CLASS,
-     "A static value for testing"
-    },
+    PyObject *target = PyTuple_GetItem(args, 0);
+    if (target == NULL || PyString_AsStringAndSize(target, &str, &len) == -1)
+        return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
+
+    /* Match-time captures need their nested captures to be recorded */
+    nocapture = !(pattflags(self) & PF_RUNTIME);
+    if (!nocapture) {
+        cc = malloc(IMAXCAPTURES * sizeof(Capture));
+        if (cc == NULL)
+            return PyErr_NoMemory();
+    }
+    e = match(str, str, str + len, self, &cc, args, nocapture);
+    free(cc);
+    if (e == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        return PyInt_FromLong(-1);
+    }
+    return PyInt_FromSsize_t(e - str);
+}
+
+/* An Aho-Corasick automaton for the strings of the trie a pattern starts
+ * with. Its states are the nodes of the trie, which give the transitions,
+ * so only the failure links and outputs are stored, by node index. Most of
+ * the failure links lead to the root's children, so these also get a full
+ * table of their transitions, failure links included.
+ */
+typedef struct Searcher {
+    int head;       /* Instruction which must match first, or -1 */
+    int usefirst;   /* With no head, does a match start with a byte of first? */
+    Charset first;
+    int maxlen;     /* Length of the longest string of the trie */
+    int *fail;      /* Node of the longest proper suffix in the trie */
+    int *out;       /* Length of the longest string ending at the node */
+    int *row;       /* Start of the node's table in next, or -1 */
+    int *next;      /* Tables of transitions, 256 entries each */
+} Searcher;
+
+/* Most instructions firstbytes() looks at before giving up */
+#define MAXFIRSTSTEPS   200
+
+/* Add to cs the bytes a match of the code at p can start with. Tests and
+ * dispatches also add the bytes of the code they fail to, and choices
+ * those of their alternative. Returns 0 if the code may match without
+ * consuming a byte of cs, or is too involved to tell.
+ */
+static int firstbytes(const Instruction *p, byte *cs, int *steps) {
+    for (;;) {
+        int c;
+        if (--*steps < 0)
+            return 0;
+        switch ((Opcode)p->i.code) {
+            case IChar:
+                setchar(cs, p->i.aux);
+                if (p->i.offset == 0)
+                    return 1;
+                p += p->i.offset;
+                continue;
+            case ISet:
+                loopset(k, cs[k] |= (p+1)->buff[k]);
+                if (p->i.offset == 0)
+                    return 1;
+                p += p->i.offset;
+                continue;
+            case ITrie:
+                for (c = 0; c <= UCHAR_MAX; ++c) {
+                    if (trietable(p)[c] != 0)
+                        setchar(cs, c);
+                }
+                return 1;
+            case IDispatch:
+                for (c = 0; c <= UCHAR_MAX; ++c) {
+                    if ((p+1)->buff[c] != 0)
+                        setchar(cs, c);
+                }
+                p += dispatchtarget(p, 0);
+                continue;
+            case IChoice:
+                if (!firstbytes(p + p->i.offset, cs, steps))
+                    return 0;
+                p++;
+                continue;
+            case IJmp:
+                p += p->i.offset;
+                continue;
+            case IFail:
+                return 1;
+            default:
+                if (iscapture(p) && isnofail(p)) {
+                    p += sizei(p);
+                    continue;
+                }
+                return 0;
+        }
+    }
+}
+
+/* The searcher of a pattern, built on first use. The instruction which must
+ * match at the start of any match is found by skipping captures, and only
+ * a string, a set or a trie are used. Otherwise, the bytes a match can
+ * start with are collected from the tests, dispatches and choices at the
+ * start of the program.
+ */
+static Searcher *pattsearcher(PyObject *patt) {
+    Instruction *op = patprog(patt);
+    Instruction *p = op;
+    const TrieWord *t;
+    Searcher *srch;
+    int *depth;
+    int nwords = 0, nrows = 0, u;
+
+    if (patsearcher(patt))
+        return patsearcher(patt);
+    while (iscapture(p) && isnofail(p))
+        p += sizei(p);
+    if (p->i.code == ITrie) {
+        nwords = (int)((p->i.offset - TRIETABSIZE) * sizeof(Instruction) /
+                       sizeof(TrieWord));
+        nrows = triekids(triewords(p)[0]);
+    }
+    srch = PyMem_Malloc(sizeof(Searcher) +
+                        (3 * nwords + nrows * (UCHAR_MAX + 1)) * sizeof(int));
+    depth = PyMem_New(int, nwords + 1);
+    if (srch == NULL || depth == NULL) {
+        PyMem_Free(srch);
+        PyMem_Del(depth);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    srch->head = -1;
+    srch->usefirst = 0;
+    srch->maxlen = 0;
+    srch->fail = (int *)(srch + 1);
+    srch->out = srch->fail + nwords;
+    srch->row = srch->out + nwords;
+    srch->next = srch->row + nwords;
+    if (p->i.code == ITrie ||
+            (ischeck(p) && (p->i.code == IChar || p->i.code == ISet)))
+        srch->head = (int)(p - op);
+    else {
+        int steps = MAXFIRSTSTEPS;
+        memset(srch->first, 0, CHARSETSIZE);
+        srch->usefirst = firstbytes(op, srch->first, &steps);
+    }
+
+    /* The trie is laid out breadth first, so the failure link of a node's
+     * parent is known when the node is reached.
+     */
+    t = triewords(p);
+    for (u = 0; u < nwords && p->i.code == ITrie; u += 1 + triekids(t[u])) {
+        int k;
+        if (u == 0) {
+            srch->fail[0] = srch->out[0] = depth[0] = 0;
+            srch->row[0] = -1;
+        }
+        for (k = 1; k <= triekids(t[u]); ++k) {
+            int v = trienode(t[u + k]);
+            int c = triebyte(t[u + k]);
+            int f = srch->fail[u];
+            depth[v] = depth[u] + 1;
+            if (u != 0) {
+                while (f != 0 && triechild(p, f, c) == 0)
+                    f = srch->fail[f];
+                f = triechild(p, f, c);
+            }
+            srch->fail[v] = f;
+            srch->out[v] = triefinal(t[v]) ? depth[v] : srch->out[f];
+            if (srch->out[v] > srch->maxlen)
+                srch->maxlen = srch->out[v];
+            srch->row[v] = -1;
+            if (u == 0) {
+                int *next = srch->next + (k - 1) * (UCHAR_MAX + 1);
+                int b;
+                for (b = 0; b <= UCHAR_MAX; ++b) {
+                    int w = triechild(p, v, b);
+                    next[b] = w ? w : triechild(p, 0, b);
+                }
+                srch->row[v] = (k - 1) * (UCHAR_MAX + 1);
+            }
+        }
+    }
+    PyMem_Del(depth);
+    patsearcher(patt) = srch;
+    return srch;
+}
+
+/* The first position from s where a string of the trie at p starts, or
+ * NULL. The automaton finds the strings by their end, so once one is found,
+ * the scan goes on while a string starting before it could still end.
+ */
+static const char *searchtrie(const Searcher *srch, const Instruction *p,
+                              const char *s, const char *e) {
+    const char *best = NULL;
+    int node = 0;
+    for (; s < e; ++s) {
+        int c = (byte)*s;
+        if (best != NULL && s - best >= srch->maxlen)
+            break;
+        if (node == 0 && best == NULL) {
+            while (trietable(p)[(byte)*s] == 0) {
+                if (++s == e)
+                    return NULL;
+            }
+            c = (byte)*s;
+        }
+        for (;;) {
+            int next;
+            if (srch->row[node] >= 0) {
+                node = srch->next[srch->row[node] + c];
+                break;
+            }
+            if ((next = triechild(p, node, c)) != 0 || node == 0) {
+                node = next;
+                break;
+            }
+            node = srch->fail[node];
+        }
+        if (srch->out[node] != 0 &&
+                (best == NULL || s + 1 - srch->out[node] < best))
+            best = s + 1 - srch->out[node];
+    }
+    return best;
+}
+
+/* The first position from s where the instruction head can match, or NULL.
+ * With no head, the first position holding one of the bytes a match can
+ * start with.
+ */
+static const char *nextcandidate(const Searcher *srch,
+                                 const Instruction *head,
+                                 const char *s, const char *e) {
+    if (head == NULL) {
+        for (; s < e; ++s) {
+            if (testchar(srch->first, (byte)*s))
+                return s;
+        }
+        return NULL;
+    }
+    switch (head->i.code) {
+        case ITrie:
+            return searchtrie(srch, head, s, e);
+        case IChar:
+            return memchr(s, head->i.aux, e - s);
+        default:  /* ISet */
+            for (; s < e; ++s) {
+                if (testchar((head+1)->buff, (byte)*s))
+                    return s;
+            }
+            return NULL;
+    }
+}
+
+/* Match at the first position from pos where the pattern matches. The
+ * start of the match is given by its start attribute. If a match must start
+ * with a string, a set, or a trie, only the positions where it occurs are
+ * tried, and otherwise only those holding a byte a match can start with,
+ * when these are known.
+ */
+static PyObject *Pattern_search(PyObject *self, PyObject *args, PyObject *kw)
+{
+    static char *kwlist[] = {"spans", "pos", NULL};
+    char *str;
+    Py_ssize_t len, pos = 0;
+    Capture *cc;
+    const char *s, *e, *r = NULL;
+    const Instruction *head = NULL;
+    Searcher *srch;
+    Match *res;
+    int spans = 0;
+
+    PyObject *target = PyTuple_GetItem(args, 0);
+    if (target == NULL || PyString_AsStringAndSize(target, &str, &len) == -1)
+        return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
+    if (checkkeywords(kw, kwlist) == -1)
+        return NULL;
+    if (kw) {
+        PyObject *val = PyDict_GetItemString(kw, "spans");
+        if (val && (spans = PyObject_IsTrue(val)) == -1)
+            return NULL;
+        val = PyDict_GetItemString(kw, "pos");
+        if (val && (pos = PyInt_AsSsize_t(val)) == -1 && PyErr_Occurred())
+            return NULL;
+        if (pos < 0 || pos > len) {
+            PyErr_SetString(PyExc_ValueError, "Search position out of range");
+            return NULL;
+        }
+    }
+    srch = pattsearcher(self);
+    if (srch == NULL)
+        return NULL;
+    if (srch->head >= 0)
+        head = patprog(self) + srch->head;
+
+    res = new_match();
+    if (res == NULL)
+        return NULL;
+    cc = malloc(IMAXCAPTURES * sizeof(Capture));
+    if (cc == NULL) {
+        Py_DECREF(res);
+        return PyErr_NoMemory();
+    }
+    e = str + len;
+    for (s = str + pos; ; ++s) {
+        if ((head != NULL || srch->usefirst) &&
+                (s = nextcandidate(srch, head, s, e)) == NULL)
+            break;
+        r = match(str, s, e, self, &cc, args, 0);
+        if (r != NULL || PyErr_Occurred() || s == e)
+            break;
+    }
+    if (r == NULL) {
+        free(cc);
+        if (PyErr_Occurred()) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        return (PyObject *)res;
+    }
+    res->start = s - str;
+    res->pos = r - str;
+    if (isendcap(cc)) {
+        free(cc);
+        return (PyObject *)res;
+    }
+    res->captures = getcaptures(self, &cc, str, r, args, spans);
+    free(cc);
+    if (res->captures == NULL) {
+        Py_DECREF(res);
+        return NULL;
+    }
+    return (PyObject *)res;
+}
+
+/* Create an array.array('i') of n zeros, and return a pointer to its data
+ * in *data.
+ */
+static PyObject *new_intarray(Py_ssize_t n, int **data) {
+    static PyObject *arraytype = NULL;
+    PyObject *arr;
+    PyObject *result;
+    void *buf;
+    Py_ssize_t buflen;
+
+    if (arraytype == NULL) {
+        PyObject *mod = PyImport_ImportModule("array");
+        if (mod == NULL)
+            return NULL;
+        arraytype = PyObject_GetAttrString(mod, "array");
+        Py_DECREF(mod);
+        if (arraytype == NULL)
+            return NULL;
+    }
+    arr = PyObject_CallFunction(arraytype, "s[i]", "i", 0);
+    if (arr == NULL)
+        return NULL;
+    result = PySequence_Repeat(arr, n);
+    Py_DECREF(arr);
+    if (result == NULL)
+        return NULL;
+    if (PyObject_AsWriteBuffer(result, &buf, &buflen) == -1) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    *data = (int *)buf;
+    return result;
+}
+
+/* Token kind of a named group capture. Int labels are used directly, other
+ * labels are looked up in kinds (if given). Groups with no kind, or a
+ * negative one, are not tokens. Kinds are cached per env index in kindcache.
+ */
+static int tokenkind(CapState *cs, Capture *cap, PyObject *kinds,
+                     long *kindcache, long *kind) {
+    PyObject *label;
+    PyObject *val;
+
+    if (captype(cap) != Cgroup || cap->idx == 0) {
+        *kind = -1;
+        return 0;
+    }
+    if (kindcache[cap->idx] != LONG_MIN) {
+        *kind = kindcache[cap->idx];
+        return 0;
+    }
+    label = env2val(cs->patt, cap->idx);
+    if (label == NULL)
+        return -1;
+    if (PyInt_Check(label)) {
+        val = label;
+        Py_INCREF(val);
+    }
+    else if (kinds == NULL || (val = PyObject_GetItem(kinds, label)) == NULL) {
+        if (PyErr_Occurred()) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+                Py_DECREF(label);
+                return -1;
+            }
+            PyErr_Clear();
+        }
+        val = PyInt_FromLong(-1);
+    }
+    Py_DECREF(label);
+    if (val == NULL)
+        return -1;
+    *kind = PyInt_AsLong(val);
+    Py_DECREF(val);
+    if (*kind == -1 && PyErr_Occurred())
+        return -1;
+    if (*kind < 0)
+        *kind = -1;
+    kindcache[cap->idx] = *kind;
+    return 0;
+}
+
+/* Match, and return the named group captures as columns of token kinds,
+ * start and end offsets, without creating any per-token objects.
+ */
+static PyObject *Pattern_tokenize(PyObject *self, PyObject *args, PyObject *kw)
+{
+    static char *kwlist[] = {"kinds", NULL};
+    char *str;
+    Py_ssize_t len;
+    Capture *cc;
+    Capture *cap;
+    const char *e;
+    CapState cs;
+    PyObject *kinds = NULL;
+    PyObject *result = NULL;
+    PyObject *kindarr = NULL, *startarr = NULL, *endarr = NULL;
+    int *kindcol, *startcol, *endcol;
+    long *kindcache = NULL;
+    Py_ssize_t *stack = NULL;  /* Token index of each open capture, or -1 */
+    Py_ssize_t envlen, i, n, depth, maxdepth;
+    long kind = -1;
+
+    PyObject *target = PyTuple_GetItem(args, 0);
+    if (target == NULL || PyString_AsStringAndSize(target, &str, &len) == -1)
+        return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
+    if (checkkeywords(kw, kwlist) == -1)
+        return NULL;
+    if (kw)
+        kinds = PyDict_GetItemString(kw, "kinds");
+
+    cc = malloc(IMAXCAPTURES * sizeof(Capture));
+    if (cc == NULL)
+        return PyErr_NoMemory();
+    e = match(str, str, str + len, self, &cc, args, 0);
+    if (e == NULL) {
+        free(cc);
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    cs.ocap = cs.cap = cc;
+    cs.s = str;
+    cs.patt = self;
+    envlen = patenv(self) ? PyList_GET_SIZE(patenv(self)) : 0;
+    kindcache = PyMem_New(long, envlen + 1);
+    if (kindcache == NULL) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    for (i = 0; i <= envlen; ++i)
+        kindcache[i] = LONG_MIN;
+
+    /* Count the tokens, and the nesting depth */
+    n = depth = maxdepth = 0;
+    for (cap = cc; depth > 0 || !isclosecap(cap); cap++) {
+        if (isclosecap(cap))
+            depth--;
+        else if (!isfullcap(cap) && ++depth > maxdepth)
+            maxdepth = depth;
+        if (tokenkind(&cs, cap, kinds, kindcache, &kind) == -1)
+            goto err;
+        if (kind >= 0)
+            n++;
+    }
+
+    stack = PyMem_New(Py_ssize_t, maxdepth + 1);
+    if (stack == NULL) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    if ((kindarr = new_intarray(n, &kindcol)) == NULL ||
+            (startarr = new_intarray(n, &startcol)) == NULL ||
+            (endarr = new_intarray(n, &endcol)) == NULL)
+        goto err;
+
+    /* Fill in the columns. Open captures are ended by their close entry. */
+    n = depth = 0;
+    for (cap = cc; depth > 0 || !isclosecap(cap); cap++) {
+        if (isclosecap(cap)) {
+            if (stack[--depth] >= 0)
+                endcol[stack[depth]] = cap->off;
+            continue;
+        }
+        tokenkind(&cs, cap, kinds, kindcache, &kind);
+        if (kind >= 0) {
+            kindcol[n] = kind;
+            startcol[n] = cap->off;
+            if (isfullcap(cap))
+                endcol[n] = closeoff(cap);
+        }
+        if (!isfullcap(cap))
+            stack[depth++] = (kind >= 0) ? n : -1;
+        if (kind >= 0)
+            n++;
+    }
+
+    result = Py_BuildValue("(nOOO)", (Py_ssize_t)(e - str),
+                           kindarr, startarr, endarr);
+
+err:
+    Py_XDECREF(kindarr);
+    Py_XDECREF(startarr);
+    Py_XDECREF(endarr);
+    PyMem_Del(stack);
+    PyMem_Del(kindcache);
+    free(cc);
+    return result;
+}
+
+/* Add an event tuple to the batch, flushing it to the handler when full */
+static int addevent(PyObject **batch, Py_ssize_t batchsize, PyObject *handler,
+                    const char *event, Capture *cap, CapState *cs,
+                    Py_ssize_t start, Py_ssize_t end) {
+    PyObject *label;
+    PyObject *ev;
+    int ret;
+
+    label = caplabel(cs->patt, captype(cap), cap->idx);
+    if (label == NULL)
+        return -1;
+    if (end < 0)
+        ev = Py_BuildValue("(ssNnO)", event, capkindnames[captype(cap)],
+                           label, start, Py_None);
+    else
+        ev = Py_BuildValue("(ssNnn)", event, capkindnames[captype(cap)],
+                           label, start, end);
+    if (ev == NULL)
+        return -1;
+    ret = PyList_Append(*batch, ev);
+    Py_DECREF(ev);
+    if (ret == -1)
+        return -1;
+    if (PyList_GET_SIZE(*batch) >= batchsize) {
+        PyObject *res = PyObject_CallFunctionObjArgs(handler, *batch, NULL);
+        if (res == NULL)
+            return -1;
+        Py_DECREF(res);
+        Py_DECREF(*batch);
+        if ((*batch = PyList_New(0)) == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/* Match, and pass the captures to handler as a stream of events, rather
+ * than building the nested capture values. Events are (event, kind, label,
+ * start, end) tuples, where event is "open", "close" or "value" (a capture
+ * with no nested captures). The end of an "open" event is None, and the
+ * label is the capture's environment value (the argument number for Arg).
+ * Events are passed to the handler in lists of up to batch events.
+ *
+ * Events are only produced once the whole match has succeeded, as until
+ * then backtracking may still drop captures. The capture array therefore
+ * grows with the number of captures, as for any match; what is saved is
+ * the tree of Python values.
+ */
+static PyObject *Pattern_parse_events(PyObject *self, PyObject *args,
+                                      PyObject *kw)
+{
+    static char *kwlist[] = {"batch", NULL};
+    char *str;
+    Py_ssize_t len;
+    Capture *cc;
+    Capture *cap;
+    const char *e;
+    CapState cs;
+    PyObject *handler;
+    PyObject *margs;
+    PyObject *batch = NULL;
+    PyObject *result = NULL;
+    Capture **stack = NULL;  /* Open captures enclosing the current one */
+    Py_ssize_t batchsize = 256;
+    Py_ssize_t i, depth, maxdepth;
+
+    if (PyTuple_Size(args) < 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "parse_events() requires a subject and a handler");
+        return NULL;
+    }
+    if (PyString_AsStringAndSize(PyTuple_GET_ITEM(args, 0), &str, &len) == -1)
+        return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
+    handler = PyTuple_GET_ITEM(args, 1);
+    if (checkkeywords(kw, kwlist) == -1)
+        return NULL;
+    if (kw) {
+        PyObject *val = PyDict_GetItemString(kw, "batch");
+        if (val) {
+            batchsize = PyInt_AsSsize_t(val);
+            if (batchsize == -1 && PyErr_Occurred())
+                return NULL;
+            if (batchsize < 1) {
+                PyErr_SetString(PyExc_ValueError, "batch must be positive");
+                return NULL;
+            }
+        }
+    }
+
+    /* Argument captures index the match arguments, which exclude handler */
+    margs = PyTuple_New(PyTuple_GET_SIZE(args) - 1);
+    if (margs == NULL)
+        return NULL;
+    for (i = 0; i < PyTuple_GET_SIZE(margs); ++i) {
+        PyObject *item = PyTuple_GET_ITEM(args, i ? i + 1 : 0);
+        Py_INCREF(item);
+        PyTuple_SET_ITEM(margs, i, item);
+    }
+
+    cc = malloc(IMAXCAPTURES * sizeof(Capture));
+    if (cc == NULL) {
+        Py_DECREF(margs);
+        return PyErr_NoMemory();
+    }
+    e = match(str, str, str + len, self, &cc, margs, 0);
+    if (e == NULL) {
+        if (!PyErr_Occurred()) {
+            result = Py_None;
+            Py_INCREF(result);
+        }
+        goto err;
+    }
+
+    cs.ocap = cs.cap = cc;
+    cs.s = str;
+    cs.patt = self;
+    cs.args = margs;
+
+    maxdepth = depth = 0;
+    for (cap = cc; depth > 0 || !isclosecap(cap); cap++) {
+        if (isclosecap(cap))
+            depth--;
+        else if (!isfullcap(cap) && ++depth > maxdepth)
+            maxdepth = depth;
+    }
+    stack = PyMem_New(Capture *, maxdepth + 1);
+    if (stack == NULL) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    if ((batch = PyList_New(0)) == NULL)
+        goto err;
+
+    depth = 0;
+    for (cap = cc; depth > 0 || !isclosecap(cap); cap++) {
+        Capture *open;
+        int ret;
+        if (isclosecap(cap)) {
+            open = stack[--depth];
+            ret = addevent(&batch, batchsize, handler, "close", open, &cs,
+                           open->off, cap->off);
+        }
+        else if (isfullcap(cap))
+            ret = addevent(&batch, batchsize, handler, "value", cap, &cs,
+                           cap->off, closeoff(cap));
+        else {
+            stack[depth++] = cap;
+            ret = addevent(&batch, batchsize, handler, "open", cap, &cs,
+                           cap->off, -1);
+        }
+        if (ret == -1)
+            goto err;
+    }
+    if (PyList_GET_SIZE(batch) > 0) {
+        PyObject *res = PyObject_CallFunctionObjArgs(handler, batch, NULL);
+        if (res == NULL)
+            goto err;
+        Py_DECREF(res);
+    }
+    result = PyInt_FromSsize_t(e - str);
+
+err:
+    Py_XDECREF(batch);
+    PyMem_Del(stack);
+    Py_DECREF(margs);
+    free(cc);
+    return result;
+}
+
+/* Match, keeping the capture tree as an array of TreeNode records owned by
+ * the match, rather than building the capture values. The tree is accessed
+ * through Node views, which are created on demand.
+ */
+static PyObject *Pattern_parse(PyObject *self, PyObject *args)
+{
+    char *str;
+    Py_ssize_t len;
+    Capture *cc;
+    Capture *cap;
+    const char *e;
+    PyObject *result;
+    Match *res;
+    TreeNode *tree;
+    Py_ssize_t *stack;  /* Indexes of the open nodes */
+    Py_ssize_t n, depth, maxdepth;
+
+    PyObject *target = PyTuple_GetItem(args, 0);
+    if (target == NULL || PyString_AsStringAndSize(target, &str, &len) == -1)
+        return NULL;
+    if (pattcompile(self) == -1)
+        return NULL;
+
+    res = new_match();
+    if (res == NULL)
+        return NULL;
+    result = (PyObject *)res;
+
+    cc = malloc(IMAXCAPTURES * sizeof(Capture));
+    if (cc == NULL) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    e = match(str, str, str + len, self, &cc, args, 0);
+    if (e == NULL) {
+        free(cc);
+        if (PyErr_Occurred()) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        return result;
+    }
+
+    n = depth = maxdepth = 0;
+    for (cap = cc; depth > 0 || !isclosecap(cap); cap++) {
+        if (isclosecap(cap))
+            depth--;
+        else {
+            n++;
+            if (!isfullcap(cap) && ++depth > maxdepth)
+                maxdepth = depth;
+        }
+    }
+    tree = PyMem_New(TreeNode, n + 1);
+    stack = PyMem_New(Py_ssize_t, maxdepth + 1);
+    if (tree == NULL || stack == NULL) {
+        PyMem_Del(tree);
+        PyMem_Del(stack);
+        free(cc);
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+
+    /* Open nodes get their end and the index after their children from the
+     * matching close entry.
+     */
+    n = depth = 0;
+    for (cap = cc; depth > 0 || !isclosecap(cap); cap++) {
+        TreeNode *node;
+        if (isclosecap(cap)) {
+            node = &tree[stack[--depth]];
+            node->end = cap->off;
+            node->after = n;
+            continue;
+        }
+        node = &tree[n];
+        node->start = cap->off;
+        node->idx = cap->idx;
+        node->kind = captype(cap);
+        if (isfullcap(cap)) {
+            node->end = closeoff(cap);
+            node->after = n + 1;
+        }
+        else
+            stack[depth++] = n;
+        n++;
+    }
+    PyMem_Del(stack);
+    free(cc);
+
+    res->pos = e - str;
+    res->tree = tree;
+    res->treelen = n;
+    /* Keep the bytes that were matched, which for a unicode subject are its
+     * default encoding rather than the object itself
+     */
+    if (PyString_Check(target)) {
+        Py_INCREF(target);
+        res->subject = target;
+    }
+    else if ((res->subject = PyString_FromStringAndSize(str, len)) == NULL) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    Py_INCREF(self);
+    res->patt = self;
+    return result;
+}
+
+/* Node - a view of one capture in a parse tree owned by a Match */
+static PyObject *new_node(Match *owner, Py_ssize_t index) {
+    Node *node = PyObject_New(Node, &NodeType);
+    if (node) {
+        Py_INCREF(owner);
+        node->owner = owner;
+        node->index = index;
+    }
+    return (PyObject *)node;
+}
+
+/* A list of views of the nodes from first up to (not including) last */
+static PyObject *node_list(Match *owner, Py_ssize_t first, Py_ssize_t last) {
+    PyObject *result = PyList_New(0);
+    Py_ssize_t i;
+
+    if (result == NULL)
+        return NULL;
+    for (i = first; i < last; i = owner->tree[i].after) {
+        PyObject *node = new_node(owner, i);
+        if (node == NULL || PyList_Append(result, node) == -1) {
+            Py_XDECREF(node);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(node);
+    }
+    return result;
+}
+
+static void Node_dealloc(Node *self)
+{
+    Py_DECREF(self->owner);
+    PyObject_Del(self);
+}
+
+#define nodeof(self) (&(self)->owner->tree[(self)->index])
+
+static PyObject *Node_kind(Node *self, void *closure) {
+    return PyString_FromString(capkindnames[nodeof(self)->kind]);
+}
+
+static PyObject *Node_label(Node *self, void *closure) {
+    TreeNode *node = nodeof(self);
+    return caplabel(self->owner->patt, node->kind, node->idx);
+}
+
+static PyObject *Node_start(Node *self, void *closure) {
+    return PyInt_FromSsize_t(nodeof(self)->start);
+}
+
+static PyObject *Node_end(Node *self, void *closure) {
+    return PyInt_FromSsize_t(nodeof(self)->end);
+}
+
+static PyObject *Node_text(Node *self, void *closure) {
+    TreeNode *node = nodeof(self);
+    return PyString_FromStringAndSize(
+            PyString_AS_STRING(self->owner->subject) + node->start,
+            node->end - node->start);
+}
+
+static PyObject *Node_children(Node *self, void *closure) {
+    return node_list(self->owner, self->index + 1, nodeof(self)->after);
+}
+
+static PyObject *Node_repr(Node *self) {
+    TreeNode *node = nodeof(self);
+    return PyString_FromFormat("<Node %s %zd:%zd>", capkindnames[node->kind],
+                               node->start, node->end);
+}
+
+static PyGetSetDef Node_getset[] = {
+    {"kind", (getter)Node_kind, NULL, "The capture kind"},
+    {"label", (getter)Node_label, NULL,
+     "The capture's environment value (group name, constant, etc)"},
+    {"start", (getter)Node_start, NULL, "The start offset in the subject"},
+    {"end", (getter)Node_end, NULL, "The end offset in the subject"},
+    {"text", (getter)Node_text, NULL, "The captured part of the subject"},
+    {"children", (getter)Node_children, NULL, "The nested captures"},
+    {NULL}
+};
+
+/* The captures list is only created when first needed, for a successful
+ * match with no captures. Failed matches and parse() results have none.
+ */
+static PyObject *Match_captures(Match *self, void *closure) {
+    if (self->captures == NULL) {
+        if (self->pos == -1 || self->tree != NULL)
+            Py_RETURN_NONE;
+        if ((self->captures = PyList_New(0)) == NULL)
+            return NULL;
+    }
+    Py_INCREF(self->captures);
+    return self->captures;
+}
+
+static PyObject *Match_nodes(Match *self, void *closure) {
+    if (self->tree == NULL)
+        Py_RETURN_NONE;
+    return node_list(self, 0, self->treelen);
+}
+
+/* **********************************************************************
+ * re syntax compiler - builds a pattern from an expression in the syntax
+ * of pe.py (whose pattern grammar is the reference implementation),
+ * without matching it against a grammar of Python callbacks. The code is
+ * the same as the reference builds. Errors are of the same kind, though a
+ * syntax error may be reported at another position.
+ * **********************************************************************
+ */
+typedef struct {
+    PyObject *cls;      /* Pattern class for the results */
+    PyObject *defs;     /* Names used by ->, => and %, or None */
+    PyObject *predef;   /* Default names for %, or None */
+    const char *s;
+    Py_ssize_t len;
+    Py_ssize_t pos;
+    int stop;           /* Set by errors which end the parse */
+    PyObject *errtype;  /* The first error in building the pattern */
+    PyObject *errvalue;
+    PyObject *errtb;
+} ReState;
+
+static PyObject *re_exp(ReState *st);
+static PyObject *re_prefix(ReState *st);
+
+/* Character i places after the current position, or NUL at the end */
+#define re_char(st, i) \
+    ((st)->pos + (i) < (st)->len ? (st)->s[(st)->pos + (i)] : '\0')
+#define re_alpha(c) (((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z'))
+#define re_digit(c) ((c) >= '0' && (c) <= '9')
+
+/* Skip the literal lit, if it is at the current position */
+static int re_lit(ReState *st, const char *lit) {
+    size_t n = strlen(lit);
+    if ((size_t)(st->len - st->pos) < n || memcmp(st->s + st->pos, lit, n) != 0)
+        return 0;
+    st->pos += n;
+    return 1;
+}
+
+/* Skip spaces and -- comments */
+static void re_space(ReState *st) {
+    for (;;) {
+        char c = re_char(st, 0);
+        if (c == ' ' || c == '\t' || c == '\n')
+            st->pos++;
+        else if (re_lit(st, "--")) {
+            while (st->pos < st->len && st->s[st->pos] != '\n')
+                st->pos++;
+        }
+        else
+            return;
+    }
+}
+
+/* The length of the name at the current position, or 0 */
+static Py_ssize_t re_namelen(ReState *st) {
+    Py_ssize_t n = 0;
+    if (!re_alpha(re_char(st, 0)))
+        return 0;
+    while (re_alpha(re_char(st, n)) || re_digit(re_char(st, n)))
+        n++;
+    return n;
+}
+
+static PyObject *re_error(ReState *st) {
+    Py_ssize_t n = st->len - st->pos;
+    st->stop = 1;
+    PyObject *near = PyString_FromStringAndSize(st->s + st->pos,
+                                                n > 20 ? 20 : n);
+    if (near == NULL)
+        return NULL;
+    PyErr_Format(PyExc_ValueError, "pattern error near '%s%s'",
+                 PyString_AS_STRING(near), n > 20 ? "..." : "");
+    Py_DECREF(near);
+    return NULL;
+}
+
+/* Skip the name at the current position and return it */
+static PyObject *re_name(ReState *st) {
+    Py_ssize_t n = re_namelen(st);
+    if (n == 0)
+        return re_error(st);
+    st->pos += n;
+    return PyString_FromStringAndSize(st->s + st->pos - n, n);
+}
+
+/* The result v of building part of the pattern. The reference
+ * implementation builds the pattern once the whole expression has matched,
+ * so syntax errors come first. Any other error is kept until the end of
+ * the parse, if it is the first one, and an empty pattern stands in for v.
+ */
+static PyObject *re_value(ReState *st, PyObject *v) {
+    if (v != NULL || st->stop)
+        return v;
+    if (st->errtype == NULL)
+        PyErr_Fetch(&st->errtype, &st->errvalue, &st->errtb);
+    else
+        PyErr_Clear();
+    return PyObject_CallFunction(st->cls, "");
+}
+
+/* Look up a name used by -> or => */
+static PyObject *re_getdef(ReState *st, PyObject *name) {
+    if (st->defs == Py_None) {
+        PyErr_Format(PyExc_ValueError, "name %s undefined",
+                     PyString_AS_STRING(name));
+        return re_value(st, NULL);
+    }
+    return re_value(st, PyObject_GetItem(st->defs, name));
+}
+
+/* Look up a name used by %, in defs and then in predef */
+static PyObject *re_getcat(ReState *st, PyObject *name) {
+    PyObject *maps[2];
+    int i;
+    maps[0] = st->defs;
+    maps[1] = st->predef;
+    for (i = 0; i < 2; ++i) {
+        PyObject *result;
+        if (maps[i] == Py_None)
+            continue;
+        result = PyObject_GetItem(maps[i], name);
+        if (result != NULL)
+            return result;
+        if (!PyErr_ExceptionMatches(PyExc_KeyError))
+            return re_value(st, NULL);
+        PyErr_Clear();
+    }
+    PyErr_Format(PyExc_ValueError, "name %s undefined",
+                 PyString_AS_STRING(name));
+    return re_value(st, NULL);
+}
+
+/* Call a Pattern class method with nargs arguments, consuming the
+ * references to them. A NULL argument means it could not be built.
+ */
+static PyObject *re_call(ReState *st, const char *meth, int nargs,
+                         PyObject *arg1, PyObject *arg2) {
+    PyObject *result = NULL;
+    if ((nargs < 1 || arg1) && (nargs < 2 || arg2))
+        result = PyObject_CallMethod(st->cls, (char *)meth,
+                                     nargs == 2 ? "OO" : nargs ? "O" : "",
+                                     arg1, arg2);
+    Py_XDECREF(arg1);
+    Py_XDECREF(arg2);
+    return re_value(st, result);
+}
+
+/* Apply a binary operator, consuming the references to p1 and p2 */
+static PyObject *re_op(ReState *st, binaryfunc op, PyObject *p1,
+                       PyObject *p2) {
+    PyObject *result;
+    if (p1 == NULL || p2 == NULL)
+        result = NULL;
+    else
+        result = op(p1, p2);
+    Py_XDECREF(p1);
+    Py_XDECREF(p2);
+    return re_value(st, result);
+}
+
+/* p ** n, consuming the reference to p */
+static PyObject *re_pow(ReState *st, PyObject *p, long n) {
+    PyObject *num = PyInt_FromLong(n);
+    PyObject *result = NULL;
+    if (num != NULL)
+        result = PyNumber_Power(p, num, Py_None);
+    Py_XDECREF(num);
+    Py_DECREF(p);
+    return re_value(st, result);
+}
+
+/* The number at the current position, with an optional sign */
+static int re_number(ReState *st, long *n) {
+    int neg = 0;
+    if (re_char(st, 0) == '+' || re_char(st, 0) == '-')
+        neg = (st->s[st->pos++] == '-');
+    if (!re_digit(re_char(st, 0))) {
+        re_error(st);
+        return -1;
+    }
+    *n = 0;
+    while (re_digit(re_char(st, 0))) {
+        if (*n > (MAXPATTSIZE * 10)) {
+            PyErr_SetString(PyExc_ValueError, "Pattern too big");
+            st->stop = 1;
+            return -1;
+        }
+        *n = *n * 10 + (st->s[st->pos++] - '0');
+    }
+    if (neg)
+        *n = -*n;
+    return 0;
+}
+
+/* The text of 'string' or "string" */
+static PyObject *re_quoted(ReState *st) {
+    char q = st->s[st->pos];
+    Py_ssize_t start = st->pos + 1;
+    const char *end = memchr(st->s + start, q, st->len - start);
+    if (end == NULL)
+        return re_error(st);
+    st->pos = end - st->s + 1;
+    return PyString_FromStringAndSize(st->s + start, end - st->s - start);
+}
+
+/* The match-time function for =name, which matches the text of the named
+ * group again
+ */
+static PyObject *re_equalcap(PyObject *self, PyObject *args) {
+    const char *s;
+    int len;
+    Py_ssize_t i;
+    PyObject *values;
+    PyObject *c;
+    if (!PyArg_ParseTuple(args, "s#nO!:equalcap", &s, &len, &i,
+                          &PyTuple_Type, &values))
+        return NULL;
+    if (PyTuple_GET_SIZE(values) != 1) {
+        PyErr_SetString(PyExc_ValueError, "Back reference must have 1 value");
+        return NULL;
+    }
+    c = PyTuple_GET_ITEM(values, 0);
+    if (PyString_Check(c) && i >= 0 && PyString_GET_SIZE(c) <= len - i &&
+            memcmp(s + i, PyString_AS_STRING(c), PyString_GET_SIZE(c)) == 0)
+        return PyInt_FromSsize_t(i + PyString_GET_SIZE(c));
+    Py_RETURN_NONE;
+}
+
+/* One item in a character class */
+static PyObject *re_item(ReState *st) {
+    char c = re_char(st, 0);
+    if (c == '%' && re_alpha(re_char(st, 1))) {
+        PyObject *name;
+        PyObject *result;
+        st->pos++;
+        if ((name = re_name(st)) == NULL)
+            return NULL;
+        result = re_getcat(st, name);
+        Py_DECREF(name);
+        return result;
+    }
+    if (st->pos + 2 < st->len && re_char(st, 1) == '-' && re_char(st, 2) != ']') {
+        char range[2];
+        range[0] = c;
+        range[1] = re_char(st, 2);
+        st->pos += 3;
+        return re_value(st, PyObject_CallMethod(st->cls, "Range", "s#",
+                                                range, 2));
+    }
+    st->pos++;
+    return re_value(st, PyObject_CallFunction(st->cls, "s#", &c, 1));
+}
+
+/* [items] or [^items] */
+static PyObject *re_class(ReState *st) {
+    Py_ssize_t start = st->pos;
+    int complement;
+    PyObject *result;
+    st->pos++;
+    complement = re_lit(st, "^");
+    if (st->pos >= st->len) {
+        st->pos = start;
+        return re_error(st);
+    }
+    /* The first item may be ] */
+    result = re_item(st);
+    while (result != NULL && re_char(st, 0) != ']') {
+        if (st->pos >= st->len) {
+            Py_DECREF(result);
+            st->pos = start;
+            return re_error(st);
+        }
+        result = re_op(st, PyNumber_Or, result, re_item(st));
+    }
+    if (result == NULL)
+        return NULL;
+    st->pos++;
+    if (complement)
+        result = re_op(st, PyNumber_Subtract,
+                       PyObject_CallFunction(st->cls, "i", 1), result);
+    return result;
+}
+
+/* The expression after an opening bracket of n characters, up to the
+ * closing text close
+ */
+static PyObject *re_enclosed(ReState *st, int n, const char *close) {
+    Py_ssize_t start = st->pos - n;
+    PyObject *result = re_exp(st);
+    if (result != NULL && !re_lit(st, close)) {
+        Py_DECREF(result);
+        st->pos = start;
+        return re_error(st);
+    }
+    return result;
+}
+
+static PyObject *re_primary(ReState *st) {
+    char c = re_char(st, 0);
+    PyObject *name;
+    PyObject *result;
+
+    if (c == '\'' || c == '"')
+        return re_call(st, "Match", 1, re_quoted(st), NULL);
+    if (c == '[')
+        return re_class(st);
+    if (c == '.') {
+        st->pos++;
+        return re_value(st, PyObject_CallFunction(st->cls, "i", 1));
+    }
+    if (re_lit(st, "("))
+        return re_enclosed(st, 1, ")");
+    if (re_lit(st, "%")) {
+        if ((name = re_name(st)) == NULL)
+            return NULL;
+        result = re_getcat(st, name);
+        Py_DECREF(name);
+        return result;
+    }
+    if (re_lit(st, "{:")) {
+        /* Named or anonymous group */
+        Py_ssize_t n = re_namelen(st);
+        if (n > 0 && re_char(st, n) == ':') {
+            name = PyString_FromStringAndSize(st->s + st->pos, n);
+            st->pos += n + 1;
+        }
+        else {
+            Py_INCREF(Py_None);
+            name = Py_None;
+        }
+        return re_call(st, "CapG", 2, re_enclosed(st, 2, ":}"), name);
+    }
+    if (re_lit(st, "=")) {
+        /* Match the same text as the named group */
+        static PyMethodDef equaldef = {"equalcap", (PyCFunction)re_equalcap,
+                                       METH_VARARGS, NULL};
+        result = re_call(st, "CapB", 1, re_name(st), NULL);
+        return re_call(st, "CapRT", 2, result, PyCFunction_New(&equaldef, NULL));
+    }
+    if (re_lit(st, "{}"))
+        return re_call(st, "CapP", 0, NULL, NULL);
+    if (re_lit(st, "{~"))
+        return re_call(st, "CapS", 1, re_enclosed(st, 2, "~}"), NULL);
+    if (re_lit(st, "{"))
+        return re_call(st, "Cap", 1, re_enclosed(st, 1, "}"), NULL);
+    if (re_lit(st, "<")) {
+        if ((name = re_name(st)) == NULL)
+            return NULL;
+        if (!re_lit(st, ">")) {
+            Py_DECREF(name);
+            return re_error(st);
+        }
+        return re_call(st, "Var", 1, name, NULL);
+    }
+    return re_error(st);
+}
+
+/* A primary followed by any number of suffix operators */
+static PyObject *re_suffix(ReState *st) {
+    PyObject *result = re_primary(st);
+    PyObject *arg;
+    long n;
+
+    while (result != NULL) {
+        re_space(st);
+        if (re_lit(st, "+"))
+            result = re_pow(st, result, 1);
+        else if (re_lit(st, "*"))
+            result = re_pow(st, result, 0);
+        else if (re_lit(st, "?"))
+            result = re_pow(st, result, -1);
+        else if (re_lit(st, "^")) {
+            int sign = (re_char(st, 0) == '+' || re_char(st, 0) == '-');
+            if (re_number(st, &n) == -1) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            if (sign)
+                result = re_pow(st, result, n);
+            else {
+                /* Exactly n repetitions */
+                PyObject *rep = re_value(st, PyObject_CallFunction(st->cls, ""));
+                while (rep != NULL && n-- > 0) {
+                    Py_INCREF(result);
+                    rep = re_op(st, PyNumber_Add, rep, result);
+                }
+                Py_DECREF(result);
+                result = rep;
+            }
+        }
+        else if (re_lit(st, "->")) {
+            re_space(st);
+            if (re_char(st, 0) == '\'' || re_char(st, 0) == '"')
+                result = re_op(st, PyNumber_Divide, result, re_quoted(st));
+            else if (re_lit(st, "{}"))
+                result = re_call(st, "CapT", 1, result, NULL);
+            else {
+                PyObject *name = re_name(st);
+                arg = name ? re_getdef(st, name) : NULL;
+                Py_XDECREF(name);
+                result = re_op(st, PyNumber_Divide, result, arg);
+            }
+        }
+        else if (re_lit(st, "=>")) {
+            PyObject *name;
+            re_space(st);
+            name = re_name(st);
+            arg = name ? re_getdef(st, name) : NULL;
+            Py_XDECREF(name);
+            if (arg == NULL) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            result = re_call(st, "CapRT", 2, result, arg);
+        }
+        else
+            break;
+    }
+    return result;
+}
+
+static PyObject *re_prefix(ReState *st) {
+    PyObject *result;
+    unaryfunc op = NULL;
+    if (re_lit(st, "&"))
+        op = PyNumber_Positive;
+    else if (re_lit(st, "!"))
+        op = PyNumber_Negative;
+    else
+        return re_suffix(st);
+
+    re_space(st);
+    if (Py_EnterRecursiveCall(" while compiling a pattern")) {
+        st->stop = 1;
+        return NULL;
+    }
+    result = re_prefix(st);
+    Py_LeaveRecursiveCall();
+    if (result != NULL) {
+        PyObject *p = op(result);
+        Py_DECREF(result);
+        result = re_value(st, p);
+    }
+    return result;
+}
+
+/* A sequence of prefix expressions, which must be followed by the end of
+ * the expression, or by something that can follow it. As in the reference,
+ * the sequence starts with P(""), so that a choice in it is compiled on its
+ * own rather than merged with a choice the sequence is part of.
+ */
+static PyObject *re_seq(ReState *st) {
+    PyObject *result = re_value(st, PyObject_CallFunction(st->cls, ""));
+    char c;
+    if (result == NULL)
+        return NULL;
+    for (;;) {
+        c = re_char(st, 0);
+        if (st->pos >= st->len || !strchr("&!(\"'[%={.<", c))
+            break;
+        result = re_op(st, PyNumber_Add, result, re_prefix(st));
+        if (result == NULL)
+            return NULL;
+    }
+    if (!(st->pos >= st->len || c == '/' || c == ')' || c == '}' ||
+          (c == ':' && re_char(st, 1) == '}') ||
+          (c == '~' && re_char(st, 1) == '}') || re_alpha(c))) {
+        Py_DECREF(result);
+        return re_error(st);
+    }
+    return result;
+}
+
+/* Check for name <- at the current position */
+static int re_isdef(ReState *st) {
+    Py_ssize_t start = st->pos;
+    Py_ssize_t n = re_namelen(st);
+    int result = 0;
+    if (n > 0) {
+        st->pos += n;
+        re_space(st);
+        result = re_lit(st, "<-");
+    }
+    st->pos = start;
+    return result;
+}
+
+/* One or more definitions, name <- exp */
+static PyObject *re_grammar(ReState *st) {
+    PyObject *rules = PyDict_New();
+    PyObject *start = NULL;
+    PyObject *kw = NULL;
+    PyObject *args = NULL;
+    PyObject *result = NULL;
+
+    if (rules == NULL)
+        return NULL;
+    while (re_isdef(st)) {
+        PyObject *name = re_name(st);
+        PyObject *exp;
+        int rv;
+        if (name == NULL)
+            goto ret;
+        if (start == NULL) {
+            Py_INCREF(name);
+            start = name;
+        }
+        re_space(st);
+        re_lit(st, "<-");
+        exp = re_exp(st);
+        if (exp == NULL)
+            rv = -1;
+        else if (PyDict_GetItem(rules, name) != NULL) {
+            PyErr_Format(PyExc_ValueError, "'%s' already defined as a rule",
+                         PyString_AS_STRING(name));
+            Py_DECREF(exp);
+            exp = re_value(st, NULL);
+            rv = exp ? 0 : -1;
+        }
+        else if (strcmp(PyString_AS_STRING(name), "start") == 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "'start' cannot be used as a rule name");
+            Py_DECREF(exp);
+            exp = re_value(st, NULL);
+            rv = exp ? 0 : -1;
+        }
+        else
+            rv = PyDict_SetItem(rules, name, exp);
+        Py_DECREF(name);
+        Py_XDECREF(exp);
+        if (rv == -1)
+            goto ret;
+    }
+    /* As for Grammar(start=start, **rules) */
+    if ((kw = PyDict_New()) == NULL ||
+            PyDict_Update(kw, rules) == -1 ||
+            PyDict_SetItemString(kw, "start", start) == -1 ||
+            (args = PyTuple_New(0)) == NULL)
+        goto ret;
+    result = re_value(st, Pattern_Grammar(st->cls, args, kw));
+
+ret:
+    Py_XDECREF(args);
+    Py_XDECREF(kw);
+    Py_XDECREF(start);
+    Py_DECREF(rules);
+    return result;
+}
+
+/* A grammar, or ordered choice of sequences */
+static PyObject *re_exp(ReState *st) {
+    PyObject *result;
+    if (Py_EnterRecursiveCall(" while compiling a pattern")) {
+        st->stop = 1;
+        return NULL;
+    }
+    re_space(st);
+    if (re_isdef(st))
+        result = re_grammar(st);
+    else {
+        result = re_seq(st);
+        while (result != NULL && re_lit(st, "/")) {
+            re_space(st);
+            result = re_op(st, PyNumber_Or, result, re_seq(st));
+        }
+    }
+    Py_LeaveRecursiveCall();
+    return result;
+}
+
+static PyObject *Pattern_Re(PyObject *cls, PyObject *args, PyObject *kw) {
+    static char *kwlist[] = {"source", "defs", "predef", NULL};
+    ReState st;
+    int len;
+    PyObject *result;
+
+    st.defs = Py_None;
+    st.predef = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "s#|OO:Re", kwlist,
+                &st.s, &len, &st.defs, &st.predef))
+        return NULL;
+    st.cls = cls;
+    st.len = len;
+    st.pos = 0;
+    st.stop = 0;
+    st.errtype = st.errvalue = st.errtb = NULL;
+    result = re_exp(&st);
+    if (result != NULL && st.pos < st.len) {
+        Py_DECREF(result);
+        result = re_error(&st);
+    }
+    if (st.stop || st.errtype == NULL) {
+        Py_XDECREF(st.errtype);
+        Py_XDECREF(st.errvalue);
+        Py_XDECREF(st.errtb);
+        return result;
+    }
+    Py_XDECREF(result);
+    PyErr_Restore(st.errtype, st.errvalue, st.errtb);
+    return NULL;
+}
+
+/* **********************************************************************
+ * Module creation - type initialisation, method tables, etc
+ * **********************************************************************
+ */
+#ifdef TRACE
+static PyMemberDef Pattern_members[] = {
+    {"trace", T_OBJECT, offsetof(Pattern, trace), READONLY},
+    {0}
+};
+#endif
+
+static PyMethodDef Pattern_methods[] = {
+    {"dump", (PyCFunction)Pattern_dump, METH_NOARGS,
+     "Build a list representing the pattern, for debugging"
+    },
+    {"display", (PyCFunction)Pattern_display, METH_NOARGS,
+     "Print the pattern, for debugging"
+    },
+    {"_set_code", (PyCFunction)Pattern_set_code, METH_VARARGS,
+     "Set the code and environ for the pattern (internal use)"
+    },
+    {"test", (PyCFunction)Pattern_test, METH_VARARGS,
+     "Match without captures, returning the end position or -1"
+    },
+    {"search", (PyCFunction)Pattern_search, METH_VARARGS | METH_KEYWORDS,
+     "Match at the first position in the string where the pattern matches"
+    },
+    {"tokenize", (PyCFunction)Pattern_tokenize, METH_VARARGS | METH_KEYWORDS,
+     "Match, returning named groups as (pos, kinds, starts, ends) int arrays"
+    },
+    {"parse_events", (PyCFunction)Pattern_parse_events,
+     METH_VARARGS | METH_KEYWORDS,
+     "Match, then pass capture events to handler in batches"
+    },
+    {"parse", (PyCFunction)Pattern_parse, METH_VARARGS,
+     "Match, keeping the captures as a tree of nodes rather than values"
+    },
+    {"compile", (PyCFunction)Pattern_compile, METH_NOARGS,
+     "Generate the code of a pattern built with + or |, and return it"
+    },
+    {"intern", (PyCFunction)Pattern_intern, METH_NOARGS,
+     "Return the first interned pattern equal to this one, interning it if there is none"
+    },
+    {"env", (PyCFunction)Pattern_env, METH_NOARGS,
+     "The pattern environment, for debugging"
+    },
+    {"Any", (PyCFunction)Pattern_Any, METH_O | METH_CLASS,
+     "A pattern which matches any character(s)"
+    },
+    {"Match", (PyCFunction)Pattern_Match, METH_O | METH_CLASS,
+     "A pattern which matches a specific string"
+    },
+    {"Fail", (PyCFunction)Pattern_Fail, METH_NOARGS | METH_CLASS,
+     "A pattern which never matches"
+    },
+    {"Set", (PyCFunction)Pattern_Set, METH_O | METH_CLASS,
+     "A pattern which matches a set of character(s)"
+    },
+    {"Range", (PyCFunction)Pattern_Range, METH_O | METH_CLASS,
+     "A pattern which matches a set of character(s) given as ranges"
+    },
+    {"Cap", (PyCFunction)Pattern_Capture, METH_O | METH_CLASS,
+     "A simple capture"
+    },
+    {"CapSpan", (PyCFunction)Pattern_CaptureSpan, METH_O | METH_CLASS,
+     "A span capture, giving the (start, end) offsets of the match"
+    },
+    {"CapNode", (PyCFunction)Pattern_CaptureNode, METH_VARARGS | METH_CLASS,
+     "A node capture, giving a (name, start, end, children) tuple"
+    },
+    {"CapInt", (PyCFunction)Pattern_CaptureInt, METH_VARARGS | METH_CLASS,
+     "An int capture, converting the match with the given base"
+    },
+    {"CapFloat", (PyCFunction)Pattern_CaptureFloat, METH_O | METH_CLASS,
+     "A float capture, converting the match"
+    },
+    {"CapDecode", (PyCFunction)Pattern_CaptureDecode,
+     METH_VARARGS | METH_CLASS,
+     "A decode capture, decoding the match with the given encoding"
+    },
+    {"CapT", (PyCFunction)Pattern_CaptureTab, METH_O | METH_CLASS,
+     "A table capture"
+    },
+    {"CapS", (PyCFunction)Pattern_CaptureSub, METH_O | METH_CLASS,
+     "A substitution capture"
+    },
+    {"CapP", (PyCFunction)Pattern_CapturePos, METH_NOARGS | METH_CLASS,
+     "A position capture"
+    },
+    {"CapA", (PyCFunction)Pattern_CaptureArg, METH_O | METH_CLASS,
+     "An argument capture"
+    },
+    {"CapC", (PyCFunction)Pattern_CaptureConst, METH_VARARGS | METH_CLASS,
+     "A constant capture"
+    },
+    {"CapB", (PyCFunction)Pattern_CaptureBack, METH_O | METH_CLASS,
+     "A back reference"
+    },
+    {"CapG", (PyCFunction)Pattern_CaptureGroup, METH_VARARGS | METH_CLASS,
+     "A group capture"
+    },
+    {"CapF", (PyCFunction)Pattern_CaptureFold, METH_VARARGS | METH_CLASS,
+     "A fold capture"
+    },
+    {"CapRT", (PyCFunction)Pattern_CaptureRuntime, METH_VARARGS | METH_CLASS,
+     "A runtime capture"
+    },
+    {"Var", (PyCFunction)Pattern_Var, METH_O | METH_CLASS,
+     "A grammar variable reference"
+    },
+    {"Re", (PyCFunction)Pattern_Re,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "A pattern given as an expression in the re syntax of pe.py"
+    },
+    {"Grammar", (PyCFunction)Pattern_Grammar,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "A grammar"
+    },
+    {"Dummy", (PyCFunction)Pattern_Dummy, METH_NOARGS | METH_CLASS,
+     "A static value for testing"
+    },
     {NULL}  /* Sentinel */
 };
 
@@ -2921,7 +6626,7 @@ static PyTypeObject PatternType = {
     &Pattern_as_number,        /*tp_as_number*/
     0,                         /*tp_as_sequence*/
     0,                         /*tp_as_mapping*/
-    0,                         /*tp_hash */
+    (hashfunc)Pattern_hash,    /*tp_hash */
     (ternaryfunc)Pattern_call, /*tp_call*/
     0,                         /*tp_str*/
     0,                         /*tp_getattro*/
@@ -3000,10 +6705,17 @@ static PyNumberMethods Match_as_number = {
 
 static PyMemberDef Match_members[] = {
     {"pos", T_LONG, offsetof(Match, pos), READONLY},
-    {"captures", T_OBJECT, offsetof(Match, captures), READONLY},
+    {"start", T_LONG, offsetof(Match, start), READONLY},
     {0}
 };
 
+static PyGetSetDef Match_getset[] = {
+    {"captures", (getter)Match_captures, NULL, "The captured values"},
+    {"nodes", (getter)Match_nodes, NULL,
+     "The top level nodes of the parse tree, for matches from parse()"},
+    {NULL}
+};
+
 static PyTypeObject MatchType = {
     PyObject_HEAD_INIT(NULL)
     0,                         /* ob_size */
@@ -3038,7 +6750,7 @@ static PyTypeObject MatchType = {
     0,                         /* tp_iternext */
     0,                         /* tp_methods */
     Match_members,             /* tp_members */
-    0,                         /* tp_getset */
+    Match_getset,              /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
@@ -3049,6 +6761,41 @@ static PyTypeObject MatchType = {
     Match_new,                 /* tp_new */
 };
 
+static PyTypeObject NodeType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /* ob_size */
+    "_ppeg.Node",              /* tp_name */
+    sizeof(Node),              /* tp_basicsize */
+    0,                         /* tp_itemsize */
+    (destructor)Node_dealloc,
+                               /* tp_dealloc */
+    0,                         /* tp_print */
+    0,                         /* tp_getattr */
+    0,                         /* tp_setattr */
+    0,                         /* tp_compare */
+    (reprfunc)Node_repr,       /* tp_repr */
+    0,                         /* tp_as_number */
+    0,                         /* tp_as_sequence */
+    0,                         /* tp_as_mapping */
+    0,                         /* tp_hash */
+    0,                         /* tp_call */
+    0,                         /* tp_str */
+    0,                         /* tp_getattro */
+    0,                         /* tp_setattro */
+    0,                         /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,        /* tp_flags*/
+    "Parse tree node",         /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    0,                         /* tp_methods */
+    0,                         /* tp_members */
+    Node_getset,               /* tp_getset */
+};
+
 static PyMethodDef _ppeg_methods[] = {
     {NULL}  /* Sentinel */
 };
@@ -3067,6 +6814,9 @@ init_ppeg(void)
     if (PyType_Ready(&MatchType) < 0)
         return;
 
+    if (PyType_Ready(&NodeType) < 0)
+        return;
+
     m = Py_InitModule3("_ppeg", _ppeg_methods, "PEG parser module.");
     if (m == NULL)
         return;
@@ -68,7 +68,8 @@ typedef enum Opcode {
   ICommit, IPartialCommit, IBackCommit, IFailTwice, IFail, IGiveup,
   IFunc,
   IFullCapture, IEmptyCapture, IEmptyCaptureIdx,
-  IOpenCapture, ICloseCapture, ICloseRunTime
+  IOpenCapture, ICloseCapture, ICloseRunTime,
+  IDispatch, ITrie
 } Opcode;
 
 
@@ -103,7 +104,9 @@ static const byte opproperties[] = {
   /* IEmptyCaptureIdx */ISCAPTURE | ISNOFAIL | ISMOVABLE | ISFENVOFF,
   /* IOpenCapture */	ISCAPTURE | ISNOFAIL | ISMOVABLE | ISFENVOFF,
   /* ICloseCapture */	ISCAPTURE | ISNOFAIL | ISMOVABLE | ISFENVOFF,
-  /* ICloseRunTime */	ISCAPTURE | ISFENVOFF
+  /* ICloseRunTime */	ISCAPTURE | ISFENVOFF,
+  /* IDispatch */	ISNOFAIL,
+  /* ITrie */		0
 };
 
 
@@ -140,19 +143,25 @@ static const Instruction giveup = {{IGiveup, 0, 0}};
 /* kinds of captures */
 typedef enum CapKind {
   Cclose, Cposition, Cconst, Cbackref, Carg, Csimple, Ctable, Cfunction,
-  Cquery, Cstring, Csubst, Cfold, Cruntime, Cgroup
+  Cquery, Cstring, Csubst, Cfold, Cruntime, Cgroup, Cspan, Cconvert
 } CapKind;
 
 #define iscapnosize(k)	((k) == Cposition || (k) == Cconst)
 
 
+/* Capture positions are offsets from the start of the subject, so subjects
+** are limited to MAXCAPOFF bytes. siz is 0 for an open capture, and
+** otherwise the length of the capture + 1.
+*/
 typedef struct Capture {
-  const char *s;  /* position */
+  unsigned int off;  /* position */
+  unsigned int siz;
   short idx;
   byte kind;
-  byte siz;
 } Capture;
 
+#define MAXCAPOFF	(UINT_MAX - 1)
+
 
 /* maximum size (in elements) for a pattern */
 #define MAXPATTSIZE	(SHRT_MAX - 10)
@@ -165,6 +174,12 @@ typedef struct Capture {
 /* size (in elements) for a ISet instruction */
 #define CHARSETINSTSIZE		instsize(CHARSETSIZE)
 
+/* size (in elements) for the byte table of a IDispatch instruction,
+   which is followed by the offsets of its targets (default first) */
+#define DISPATCHTABSIZE		instsize(UCHAR_MAX + 1)
+
+#define dispatchtarget(p,k)	((p)[DISPATCHTABSIZE + (k)].i.offset)
+
 
 
 #define loopset(v,b)	{ int v; for (v = 0; v < CHARSETSIZE; v++) b; }
@@ -177,7 +192,9 @@ typedef struct Capture {
 
 static int sizei (const Instruction *i) {
   if (hascharset(i)) return CHARSETINSTSIZE;
-  else if (i->i.code == IFunc) return i->i.offset;
+  else if (i->i.code == IFunc || i->i.code == IDispatch ||
+           i->i.code == ITrie)
+    return i->i.offset;
   else return 1;
 }
 
@@ -236,7 +253,7 @@ static void printcapkind (int kind) {
     "close", "position", "constant", "backref",
     "argument", "simple", "table", "function",
     "query", "string", "substitution", "fold",
-    "runtime", "group"};
+    "runtime", "group", "span", "convert"};
   printf("%s", modes[kind]);
 }
 
@@ -256,7 +273,7 @@ static void printinst (const Instruction *op, const Instruction *p) {
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
      "func",
      "fullcapture", "emptycapture", "emptycaptureidx", "opencapture",
-     "closecapture", "closeruntime"
+     "closecapture", "closeruntime", "dispatch", "trie"
   };
   printf("%02ld: %s ", (long)(p - op), names[p->i.code]);
   switch ((Opcode)p->i.code) {
@@ -300,6 +317,13 @@ static void printinst (const Instruction *op, const Instruction *p) {
       printjmp(op, p);
       break;
     }
+    case IDispatch: {
+      int k;
+      printf("->");
+      for (k = 0; k <= p->i.aux; k++)
+        printf(" %d", (int)(p + dispatchtarget(p, k) - op));
+      break;
+    }
     default: break;
   }
   printf("\n");
@@ -318,12 +342,12 @@ static void printpatt (Instruction *p) {
 
 static void printcap (Capture *cap) {
   printcapkind(cap->kind);
-  printf(" (idx: %d - size: %d) -> %p\n", cap->idx, cap->siz, cap->s);
+  printf(" (idx: %d - size: %u) -> %u\n", cap->idx, cap->siz, cap->off);
 }
 
 
 static void printcaplist (Capture *cap) {
-  for (; cap->s; cap++) printcap(cap);
+  for (; cap->kind != Cclose || cap->siz != 0; cap++) printcap(cap);
 }
 
 /* }====================================================== */
@@ -362,19 +386,19 @@ static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop) {
 #endif
 
 
-static void adddyncaptures (const char *s, Capture *base, int n, int fd) {
+static void adddyncaptures (unsigned int off, Capture *base, int n, int fd) {
   int i;
   assert(base[0].kind == Cruntime && base[0].siz == 0);
   base[0].idx = fd;  /* first returned capture */
   for (i = 1; i < n; i++) {  /* add extra captures */
     base[i].siz = 1;  /* mark it as closed */
-    base[i].s = s;
+    base[i].off = off;
     base[i].kind = Cruntime;
     base[i].idx = fd + i;  /* stack index */
   }
   base[n].kind = Cclose;  /* add closing entry */
   base[n].siz = 1;
-  base[n].s = s;
+  base[n].off = off;
 }
 
 
@@ -854,24 +878,33 @@ static int skipchecks (Instruction *p, int up, int *pn) {
 static void optimizecaptures (Instruction *p) {
   int i;
   int limit = 0;
+  int run = 0;  /* first of the movable captures just before i */
   for (i = 0; p[i].i.code != IEnd; i += sizei(p + i)) {
+    if (!ismovablecap(p + i))
+      run = i + sizei(p + i);
+    if (p[i].i.code == IDispatch) {
+      int k;
+      for (k = 0; k <= p[i].i.aux; k++)
+        if (i + dispatchtarget(p + i, k) >= limit)
+          limit = i + dispatchtarget(p + i, k) + 1;
+    }
     if (isjmp(p + i) && dest(p, i) >= limit)
       limit = dest(p, i) + 1;  /* do not optimize jump targets */
     else if (i >= limit && ismovablecap(p + i) && ischeck(p + i + 1)) {
       int end, n, j;  /* found a border capture|check */
-      int maxoff = getoff(p + i);
-      int start = i;
-      /* find first capture in the group */
-      while (start > limit && ismovablecap(p + start - 1)) {
-        start--;
-        if (getoff(p + start) > maxoff) maxoff = getoff(p + start);
-      }
+      int maxoff = 0;
+      /* first capture in the group (scanning backwards is not safe, as
+         it could stop in the middle of a multi-slot instruction) */
+      int start = (run > limit) ? run : limit;
+      for (j = start; j <= i; j++)
+        if (getoff(p + j) > maxoff) maxoff = getoff(p + j);
       end = skipchecks(p + i + 1, maxoff, &n) + i;  /* find last check */
       if (n == 0) continue;  /* first check is too big to move across */
       assert(n <= MAXOFF && start <= i && i < end);
       for (j = start; j <= i; j++)
         p[j].i.aux += (n << 4);  /* correct offset of captures to be moved */
       rotate(p + start, end - start, i - start + 1);  /* move them up */
+      run = end - (i - start);
       i = end;
       assert(ischeck(p + start) && iscapture(p + i));
     }
@@ -1802,6 +1835,8 @@ typedef struct CapState {
   PyObject *args; /* args of match call */
   PyObject *patt; /* pattern */
   const char *s;  /* original string */
+  int spans;  /* return simple captures as (start, end) spans */
+  Capture **backrefs;  /* group referred to by each back reference, or NULL */
 #if 0
   int valuecached;  /* value stored in cache slot */
 #endif
@@ -1812,10 +1847,17 @@ typedef struct CapState {
 
 #define isclosecap(cap)	(captype(cap) == Cclose)
 
-#define closeaddr(c)	((c)->s + (c)->siz - 1)
+#define capaddr(cs,c)	((cs)->s + (c)->off)
+
+#define closeoff(c)	((c)->off + (c)->siz - 1)
+
+#define closeaddr(cs,c)	((cs)->s + closeoff(c))
 
 #define isfullcap(cap)	((cap)->siz != 0)
 
+/* the entry after the last capture is a close with no size */
+#define isendcap(cap)	(isclosecap(cap) && (cap)->siz == 0)
+
 #if 0
 #define getfromenv(cs,v)	lua_rawgeti((cs)->L, penvidx((cs)->ptop), v)
 #define pushluaval(cs)		getfromenv(cs, (cs)->cap->idx)
@@ -2034,7 +2076,7 @@ typedef struct StrAux {
 static int getstrcaps (CapState *cs, StrAux *cps, int n) {
   int k = n++;
   cps[k].isstring = 1;
-  cps[k].u.s.s = cs->cap->s;
+  cps[k].u.s.s = capaddr(cs, cs->cap);
   if (!isfullcap(cs->cap++)) {
     while (!isclosecap(cs->cap)) {
       if (n >= MAXSTRCAPS)  /* too many captures? */
@@ -2050,7 +2092,7 @@ static int getstrcaps (CapState *cs, StrAux *cps, int n) {
     }
     cs->cap++;  /* skip close */
   }
-  cps[k].u.s.e = closeaddr(cs->cap - 1);
+  cps[k].u.s.e = closeaddr(cs, cs->cap - 1);
   return n;
 }
 
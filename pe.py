@@ -1,3 +1,4 @@
+from collections import namedtuple, OrderedDict
 from operator import add, div, mul, neg
 
 from _ppeg import Pattern as P
@@ -6,7 +7,7 @@ def pattprint(pattern):
     print pattern.env()
     pattern.display()
 
-mt = P(1)
+mt = P
 ANY = P(1)
 
 predef = {
@@ -14,13 +15,14 @@ predef = {
 }
 
 def getdef(name, defs):
-    c = defs and defs[name]
-    return c
+    if defs is None:
+        raise ValueError('name %s undefined' % (name,))
+    return defs[name]
 
 def patt_error(s, i):
-    msg = (len(s) < i + 20) and s[i] or s[i:i+20] + '...'
+    msg = s[i:i+20] + (len(s) > i + 20 and '...' or '')
     msg = "pattern error near '%s'" % (msg, )
-    raise Exception(msg)
+    raise ValueError(msg)
 
 def mult(p, n):
     """Returns a Pattern that matches exactly n repetitions of Pattern p.
@@ -57,16 +59,16 @@ String = (("'" + P.Cap((ANY - "'")**0) + "'") |
 
 
 def getcat(c, defs):
-    cat = defs.get(c, predef.get(c))
+    cat = defs[c] if defs and c in defs else predef.get(c)
     if not cat:
-        raise Exception('name %s undefined' % (c,))
+        raise ValueError('name %s undefined' % (c,))
     return cat
 
 Cat = ('%' + Identifier) / getcat
 
 Range   = P.CapS(ANY + (P("-")/"") + (ANY-"]")) / P.Range
 
-item    = Cat | Range | P.Cap(ANY)
+item    = Cat | Range | P.Cap(ANY) / P
 
 
 def f(c, p):
@@ -79,17 +81,30 @@ Class   = ( ("[" + P.Cap(P("^")**-1) # optional complement symbol
                  + P.CapF(item + (item - "]")**0, mt.__or__)) / f
            ) + "]"
 
-def adddef(d, k, defs, exp):
+def adddef(d, rule):
+    k, defs, exp = rule
     if d.get(k):
-        raise Exception("'%s' already defined as a rule" % k)
+        raise ValueError("'%s' already defined as a rule" % k)
     d[k] = exp
     return d
 
+class Defs(dict):
+    start = None
+
 def firstdef(n, defs, r):
-    return adddef({}, k, defs, r)
+    d = Defs()
+    d.start = n
+    return adddef(d, (n, defs, r))
+
+def grammar(d):
+    return P.Grammar(start=d.start, **d)
+
+def pack(*args):
+    return args
 
-def abf(a, b, f):
-    return f(a, b)
+def abf(a, args):
+    # The last value is the function, applied to a and the other values
+    return args[-1](a, *args[:-1])
 
 def np(n, p):
     return P.CapG(p, n)
@@ -114,15 +129,15 @@ exp = P.Grammar(
              | P("*") + P.CapC(0, mt.__pow__)
              | P("?") + P.CapC(-1, mt.__pow__)
              | "^" + ( P.CapG(num + P.CapC(mult))
-                     | P.CapG(P.Cap(P.Set("+-") + P.Range("09")**1)
+                     | P.CapG(P.CapInt(P.Set("+-") + P.Range("09")**1)
                               + P.CapC(mt.__pow__))
                      )
              | "->" + S + ( P.CapG(String + P.CapC(mt.__div__))
-                          | P("{}") + P.CapC(None, P.CapT)
+                          | P("{}") + P.CapC(P.CapT)
                           | P.CapG(Identifier / getdef + P.CapC(mt.__div__))
                           )
              | "=>" + S + P.CapG(Identifier / getdef + P.CapC(P.CapRT))
-             ) + S
+             ) / pack + S
             )**0, abf)),
 
     # 4 Primary
@@ -131,7 +146,7 @@ exp = P.Grammar(
     | Class
     | Cat
     | ("{:" + (name + ":" | P.CapC(None)) + P.Var(0) + ":}") / np
-    | ("=" + name) / (lambda n: CapRT(CapB(n), equalcap))
+    | ("=" + name) / (lambda n: P.CapRT(P.CapB(n), equalcap))
     | P("{}") / P.CapP
     | ("{~" + P.Var(0) + "~}") / P.CapS
     | ("{"  + P.Var(0) +  "}") / P.Cap
@@ -140,16 +155,61 @@ exp = P.Grammar(
     # 5 Definition
     (Identifier + S + '<-' + P.Var(0)),
     # 6 Grammar
-    (P.CapF(P.Var(5) / firstdef + P.CapG(P.Var(5))**0, adddef) / P.Grammar),
+    (P.CapF(P.Var(5) / firstdef + (P.Var(5) / pack)**0, adddef) / grammar),
 )
 #pattprint(exp)
-pattern = (S + exp) / P + (-ANY | patt_error)
+pattern = S + exp + (-ANY | patt_error)
+
+
+# Compiled patterns, most recently used last, keyed by source and the
+# identity of defs. Each entry keeps defs alive, so that its id is not
+# reused while the entry exists.
+MAXCACHE = 256
+_cache = OrderedDict()
+_hits = _misses = 0
 
+CacheInfo = namedtuple('CacheInfo', 'hits misses maxsize currsize')
 
 def compile(p, defs=None):
+    """Compile the expression p, using the patterns and functions in defs.
+
+    Results are cached, so defs should not be changed once it has been
+    used (or purge() should be called after changing it).
+    """
+    global _hits, _misses
+    key = (type(p), p, id(defs))
+    entry = _cache.pop(key, None)
+    if entry is not None and entry[0] is defs:
+        _hits += 1
+        _cache[key] = entry
+        return entry[1]
+    _misses += 1
+    result = P.Re(p, defs, predef)
+    if MAXCACHE > 0:
+        while len(_cache) >= MAXCACHE:
+            _cache.popitem(last=False)
+        _cache[key] = (defs, result)
+    return result
+
+def compile_py(p, defs=None):
+    """Compile the expression p using the pattern grammar above.
+
+    This is the reference implementation of Pattern.Re, which compile()
+    uses.
+    """
     m = pattern(p, defs)
     return m.captures[0]
 
+def purge():
+    """Clear the compiled pattern cache."""
+    global _hits, _misses
+    _cache.clear()
+    _hits = _misses = 0
+
+def cache_info():
+    """Return the hits, misses, maximum and current size of the cache."""
+    return CacheInfo(_hits, _misses, MAXCACHE, len(_cache))
+
 balanced = compile('balanced <- "(" ([^()] / <balanced>)* ")"')
 if __name__ == '__main__':
     print '(hello())', balanced('(hello())').pos
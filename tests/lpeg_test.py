@@ -370,8 +370,7 @@ def test_for_errors():
 
     with pytest.raises(RuntimeError) as excinfo:
         match(P.Grammar(P.Var('hiii')), '')
-    # TODO The exception matches, but wrong error message: invalid op code
-    #assert excinfo.value.message == "rule 'hiii' is not defined"
+    assert excinfo.value.message == "rule 'hiii' is not defined"
 
     with pytest.raises(RuntimeError) as excinfo:
         match(P.Grammar(P.Var({})), '')
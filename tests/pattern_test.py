@@ -2,8 +2,10 @@ from __future__ import with_statement
 
 from unittest import TestCase, main
 import sys
+import random
 from cStringIO import StringIO
 from contextlib import contextmanager
+import ctypes
 
 from _ppeg import Pattern as P
 
@@ -345,6 +347,57 @@ class TestGrammar(TestCase):
     def testleftrecursion(self):
         self.assertRaises(RuntimeError, P.Grammar, P.Var(0) + P(1))
 
+    def testleftrecursionafterempty(self):
+        # The first alternative matching the empty string does not stop
+        # the second from being a left recursive call
+        self.assertRaises(RuntimeError, P.Grammar, -P("c") | P.Var(0))
+        self.assertRaises(RuntimeError, P.Grammar,
+                          P.Var(1), P("a") + P.Var(0) | P.Var(2) + P.Var(1), P(0))
+
+    def testdeepgrammar(self):
+        n = 1000
+        rules = dict(("r%d" % i, "b" | P.Var("r%d" % (i + 1)))
+                     for i in range(n))
+        rules["r%d" % n] = P("c")
+        p = P.Grammar(start="r0", **rules)
+        self.assertEqual(p("c").pos, 1)
+        rules["r%d" % n] = P.Var("r0")
+        self.assertRaises(RuntimeError, P.Grammar, start="r0", **rules)
+
+    def testinline(self):
+        p = P.Grammar(P.Var("a") + P.Var("b") + P.Var("a"),
+                      a=P.Set("xy"), b=P.Cap(P.Var("a")))
+        ops = [op[0] for op in p.dump()]
+        self.assertEqual(ops.count("call"), 1)
+        self.assertEqual(p("xyx").captures, ["y"])
+        self.assertEqual(p("xzx").pos, -1)
+
+    def testdeadrules(self):
+        p = P.Grammar(P(1), unused=P.Match("abcdef") + P.Var("unused") | P(""))
+        self.assertEqual([op[0] for op in p.dump()],
+                         ["call", "jmp", "any", "ret", "end"])
+        self.assertRaises(RuntimeError, P.Grammar, P(1), unused=P.Var("x"))
+
+    def testrulesunchanged(self):
+        a = P.Var(1)
+        for i in range(3):
+            P.Grammar(a, P(1), P(1) + P.Var(1))
+        self.assertEqual(a.env(), [1])
+
+    def testmanyrules(self):
+        n = 4000
+        rules = dict(("r%d" % i, P("a") + P.Var("r%d" % ((i + 1) % n)) | P("b"))
+                     for i in range(n))
+        for i in range(10):
+            p = P.Grammar(start="r0", **rules)
+        self.assertEqual(p("a" * 5000 + "b").pos, 5001)
+
+    def testrecursivenotinlined(self):
+        p = P.Grammar(P("(") + P.Var(0)**0 + P(")"))
+        ops = [op[0] for op in p.dump()]
+        self.assertEqual(ops.count("call"), 2)
+        self.assertEqual(p("(()(()))").pos, 8)
+
 
 class TestDummy(TestCase):
     def testbuilddummy(self):
@@ -385,6 +438,13 @@ class TestCaptureBug(TestCase):
         result = s.getvalue()
         for l1, l2 in zip(lines(result), lines(expected)):
             self.assertEqual(l1, l2)
+
+    def testmultislot(self):
+        # The last slot of the set looks like a capture instruction, and
+        # must not be moved along with the capture after the set
+        p = P.Set("\xc2\xc4") + P.CapP() + "a"
+        self.assertEqual(p("\xc2a").captures, [1])
+        self.assertEqual(p("\xc4a").pos, 2)
 
 
 class TestSubclass(TestCase):
@@ -483,6 +543,15 @@ class TestOtherCap(TestCase):
             return a
         p = P.CapF(P.CapC([]) + P(1) + (P.Cap(P(2))**1), fn)
         self.assertEqual(p("abcdefg").captures, [["BC", "DE", "FG"]])
+
+    def testfolderror(self):
+        def fn(acc, val):
+            raise ValueError(val)
+        p = P.CapF(P.Cap(P(1)) + P.Cap(P(1)), fn)
+        self.assertRaises(ValueError, p, "ab")
+        # A capture with no values calls fn(accum)
+        p = P.CapF(P.Cap(P(1)) + P.CapG(P(1), "x"), lambda acc: acc + "!")
+        self.assertEqual(p("ab").captures, ["a!"])
 
 
 class TestRuntimeCap(TestCase):
@@ -498,6 +567,855 @@ class TestRuntimeCap(TestCase):
         self.assertEqual(matchtwo("aab").pos, 2)
         self.assertEqual(matchtwo("ab").pos, -1)
 
+    def testsubject(self):
+        # The function gets the subject itself, even with null bytes
+        subject = "ab\0cd"
+        seen = []
+        def fn(s, pos, caps):
+            seen.append(s)
+            return True
+        P.CapRT(P(3), fn)(subject)
+        self.assertTrue(seen[0] is subject)
+
+    def testtwoargs(self):
+        # Nested captures are not built for a (subject, position) function
+        built = []
+        inner = P.Cap(P(1)) / (lambda c: built.append(c))
+        p = P.CapRT(inner, lambda s, i: i + int(s[i - 1]))
+        self.assertEqual(p("3abc").pos, 4)
+        self.assertEqual(built, [])
+
+    def testreturns(self):
+        self.assertEqual(P.CapRT(P(1), lambda s, i: 3L)("abc").pos, 3)
+        self.assertEqual(P.CapRT(P(1), lambda s, i: False)("abc").pos, -1)
+        p = P.CapRT(P(1), lambda s, i: 1.5)
+        self.assertRaises(TypeError, p, "abc")
+
 
+class TestSpanCap(TestCase):
+    def testfull(self):
+        p = P(1) + P.CapSpan(P(2))
+        self.assertEqual(p("abcd").captures, [(1, 3)])
+
+    def testnested(self):
+        p = P.CapSpan(P(1) + P.CapSpan(P("b")**1) + P.Cap(P(1)))
+        self.assertEqual(p("abbc").captures, [(0, 4), (1, 3), "c"])
+
+    def testspansoption(self):
+        p = P.Cap(P(1) + P.Cap(P(2))) + P.CapP()
+        self.assertEqual(p("abcd", spans=True).captures, [(0, 3), (1, 3), 3])
+        self.assertEqual(p("abcd").captures, ["abc", "bc", 3])
+        self.assertRaises(TypeError, p, "abcd", span=True)
+
+    def testspanslong(self):
+        p = P.Cap(P(1)**0)
+        self.assertEqual(p("a" * 1000, spans=True).captures, [(0, 1000)])
+
+    def testspanssubst(self):
+        # Substitutions are built from the text, whatever the option
+        p = P.CapS(P.Cap(P("a")) + P.Cap(P.Cap(P("b")) + P("c")))
+        self.assertEqual(p("abc", spans=True).captures, ["abc"])
+        p = P.CapS(P.Cap(P("a")) / "[%1]")
+        self.assertEqual(p("a", spans=True).captures, ["[a]"])
+
+
+class TestTest(TestCase):
+    def testpos(self):
+        p = P.Cap(P(1)) + P.CapP() + P("b")
+        self.assertEqual(p.test("abc"), 2)
+        self.assertEqual(p.test("aac"), -1)
+        self.assertEqual(P(0).test(""), 0)
+
+    def testruntime(self):
+        def fn(subject, pos, caps):
+            if subject[pos:].startswith(caps[0]):
+                return pos + len(caps[0])
+            return None
+        p = P.CapRT(P.Cap(P(1)), fn)
+        self.assertEqual(p.test("aa"), 2)
+        self.assertEqual(p.test("ab"), -1)
+
+    def testsameasmatch(self):
+        p = P.CapS(P.Cap(P.Set("ab")**1) + P.CapC("x")) + P(-1)
+        for s in ["", "a", "abba", "abc"]:
+            self.assertEqual(p.test(s), p(s).pos)
+
+
+class TestTokenize(TestCase):
+    def setUp(self):
+        word = P.CapG(P.Set("abc")**1, 1)
+        num = P.CapG(P.Set("0123456789")**1, "num")
+        self.p = (P(" ")**0 + (word | num))**0
+
+    def testintlabels(self):
+        pos, kinds, starts, ends = self.p.tokenize("ab 12 c")
+        self.assertEqual(pos, 7)
+        self.assertEqual(list(kinds), [1, 1])
+        self.assertEqual(list(starts), [0, 6])
+        self.assertEqual(list(ends), [2, 7])
+        self.assertRaises(TypeError, self.p.tokenize, "ab", kind={})
+
+    def testkinds(self):
+        pos, kinds, starts, ends = self.p.tokenize("ab 12 c", kinds={"num": 7})
+        self.assertEqual(list(kinds), [1, 7, 1])
+        self.assertEqual(list(starts), [0, 3, 6])
+        self.assertEqual(list(ends), [2, 5, 7])
+
+    def testnested(self):
+        p = P.CapG(P.CapG(P("a"), 2) + P("b"), 1)
+        pos, kinds, starts, ends = p.tokenize("ab")
+        self.assertEqual(list(kinds), [1, 2])
+        self.assertEqual(list(starts), [0, 0])
+        self.assertEqual(list(ends), [2, 1])
+
+    def testfail(self):
+        self.assertEqual(P("x").tokenize("y"), None)
+
+
+class TestParseEvents(TestCase):
+    def testevents(self):
+        batches = []
+        p = P.CapT(P.Cap(P("a")) + P.CapG(P.Cap(P("b")), "x")) + P.CapA(1)
+        self.assertEqual(p.parse_events("ab", batches.append, "arg"), 2)
+        self.assertEqual(sum(batches, []), [
+            ("open", "Table", None, 0, None),
+            ("value", "Simple", None, 0, 1),
+            ("open", "Group", "x", 1, None),
+            ("value", "Simple", None, 1, 2),
+            ("close", "Group", "x", 1, 2),
+            ("close", "Table", None, 0, 2),
+            ("value", "Arg", 1, 2, 2),
+        ])
+
+    def testbatch(self):
+        batches = []
+        p = P.Cap(P(1))**0
+        self.assertEqual(p.parse_events("abcde", batches.append, batch=2), 5)
+        self.assertEqual([len(b) for b in batches], [2, 2, 1])
+        self.assertRaises(TypeError, p.parse_events, "ab", batches.append,
+                          batches=2)
+
+    def testfail(self):
+        batches = []
+        self.assertEqual(P.Cap(P("x")).parse_events("y", batches.append),
+                         None)
+        self.assertEqual(batches, [])
+
+    def testhandlererror(self):
+        def handler(events):
+            raise ValueError
+        self.assertRaises(ValueError, P.Cap(P(1)).parse_events, "a", handler)
+
+
+class TestNodeCap(TestCase):
+    def testleaf(self):
+        p = P.CapNode(P("ab"), "x")
+        self.assertEqual(p("abc").captures, [("x", 0, 2, [])])
+
+    def testtree(self):
+        num = P.CapNode(P.Set("0123456789")**1, "num")
+        lst = P.CapNode(P("[") + (num + P(",")**-1)**0 + P("]"), "list")
+        self.assertEqual(lst("[1,23]").captures, [
+            ("list", 0, 6, [("num", 1, 2, []), ("num", 3, 5, [])])])
+
+    def testchildvalues(self):
+        p = P.CapNode(P.Cap(P("a")) + P.CapC(3) + P(""), "x")
+        self.assertEqual(p("ab").captures, [("x", 0, 1, ["a", 3])])
+
+    def testnoname(self):
+        self.assertRaises(TypeError, P.CapNode, P("a"), None)
+
+
+class TestParse(TestCase):
+    def setUp(self):
+        num = P.CapNode(P.Set("0123456789")**1, "num")
+        self.p = P.CapNode(P("[") + (num + P(",")**-1)**0 + P("]"), "list")
+
+    def testtree(self):
+        m = self.p.parse("[1,23]x")
+        self.assertEqual(m.pos, 6)
+        self.assertEqual(m.captures, None)
+        self.assertEqual(len(m.nodes), 1)
+        root = m.nodes[0]
+        self.assertEqual((root.label, root.start, root.end, root.text),
+                         ("list", 0, 6, "[1,23]"))
+        self.assertEqual([(c.label, c.text) for c in root.children],
+                         [("num", "1"), ("num", "23")])
+        self.assertEqual(root.children[0].children, [])
+
+    def testkinds(self):
+        p = P.Cap(P("a")) + P.CapC(3) + P.CapA(1)
+        nodes = p.parse("a", "arg").nodes
+        self.assertEqual([n.kind for n in nodes], ["Simple", "Const", "Arg"])
+        self.assertEqual([n.label for n in nodes], [None, 3, 1])
+
+    def testnodeoutlivesmatch(self):
+        root = self.p.parse("[1,23]").nodes[0]
+        self.assertEqual(root.children[1].text, "23")
+
+    def testfail(self):
+        m = self.p.parse("x")
+        self.assertFalse(m)
+        self.assertEqual(m.nodes, None)
+
+    def testnotparse(self):
+        self.assertEqual(self.p("[1]").nodes, None)
+
+    def testunicode(self):
+        root = self.p.parse(u"[1,23]").nodes[0]
+        self.assertEqual(root.text, "[1,23]")
+        self.assertEqual(root.children[1].text, "23")
+
+
+class TestLongCapture(TestCase):
+    def testvalue(self):
+        p = P.Cap(P.Cap(P(300)) + P.Cap(P(1)))
+        self.assertEqual([len(c) for c in p("a" * 400).captures],
+                         [301, 300, 1])
+
+    def testsingleentry(self):
+        events = []
+        P.Cap(P(1000)).parse_events("a" * 1000, events.extend)
+        self.assertEqual(events, [("value", "Simple", None, 0, 1000)])
+
+
+class TestStringBuild(TestCase):
+    def testlong(self):
+        w = P.Cap(P.Set("abc")**1)
+        p = P.CapS((w / "<%1>" | P(1))**0)
+        self.assertEqual(p("ab x " * 100).captures, ["<ab> x " * 100])
+
+    def testnonstring(self):
+        p = P.CapS((P.CapP() + P(1))**0)
+        self.assertEqual(p("abc").captures, ["0a1b2c"])
+
+    def teststringcap(self):
+        p = (P.Cap(P(1)) + P.Cap(P(1))) / "%2%1%%%0"
+        self.assertEqual(p("xy").captures, ["yx%xy"])
+
+    def testnested(self):
+        p = P.CapS(P.CapS(P.Cap(P("a")) / "[%1]" + P("b")))
+        self.assertEqual(p("ab").captures, ["[a]b"])
+
+    def testspans(self):
+        p = P.CapS(P.Cap(P("a")))
+        self.assertEqual(p("a", spans=True).captures, ["a"])
+
+
+class TestMatchObject(TestCase):
+    def testnocaptures(self):
+        m = P("a")("a")
+        self.assertEqual(m.captures, [])
+        self.assertTrue(m.captures is m.captures)
+
+    def testnotshared(self):
+        m1 = P("a")("a")
+        m2 = P("a")("a")
+        m1.captures.append(1)
+        self.assertEqual(m2.captures, [])
+
+    def testfail(self):
+        self.assertEqual(P("a")("b").captures, None)
+
+    def testreuse(self):
+        for i in range(200):
+            m = P.Cap(P(1))("x%d" % i)
+            self.assertEqual((m.pos, m.captures), (1, ["x"]))
+
+
+class TestBackref(TestCase):
+    def testlatest(self):
+        p = (P.CapG(P.Cap(P(1)), "x") + P.CapG(P.Cap(P(1)), "x") +
+             P.CapB("x"))
+        self.assertEqual(p("ab").captures, ["b"])
+
+    def testnested(self):
+        # A group inside an earlier capture is not visible afterwards
+        inner = P.CapT(P.CapG(P.Cap(P(1)), "x"))
+        p = P.CapG(P.Cap(P(1)), "x") + inner + P.CapB("x")
+        self.assertEqual(p("ab").captures[-1], "a")
+
+    def testenclosing(self):
+        # The enclosing group is not visible inside itself
+        p = P.CapG(P.Cap(P(1)), "x") + P.CapG(P.Cap(P(1)) + P.CapB("x"), "x")
+        self.assertEqual(p("ab").captures, [])
+        p = p + P.CapB("x")
+        self.assertEqual(p("ab").captures, ["b", "a"])
+
+    def testmissing(self):
+        p = P.CapT(P.CapB("x"))
+        self.assertRaises(RuntimeError, p, "")
+
+    def testmany(self):
+        p = P.CapG(P.Cap(P(1)), "x") + (P.Cap(P(1)) + P.CapB("x"))**0
+        self.assertEqual(p("a" * 2000).captures, ["a"] * 3998)
+
+
+class TestPe(TestCase):
+    def setUp(self):
+        import pe
+        self.pe = pe
+
+    def testbalanced(self):
+        self.assertEqual(self.pe.balanced("(a(b)c)").pos, 7)
+        self.assertEqual(self.pe.balanced("(a(b)c").pos, -1)
+
+    def testfunction(self):
+        p = self.pe.compile('{"a"+} -> up "b"?', {'up': lambda s: s.upper()})
+        self.assertEqual(p("aab").captures, ["AA"])
+
+    def testgrammar(self):
+        p = self.pe.compile('s <- "x" <t>  t <- "y"')
+        self.assertEqual(p("xy").pos, 2)
+
+
+class TestConvertCap(TestCase):
+    def testint(self):
+        digits = P.Range("09")**1
+        self.assertEqual(P.CapInt(digits)("1234").captures, [1234])
+        p = P.CapInt(P.Set("0123456789abcdef")**1, 16)
+        self.assertEqual(p("ff").captures, [255])
+        self.assertEqual(P.CapInt(digits)("9" * 80).captures,
+                         [int("9" * 80)])
+
+    def testfloat(self):
+        p = P.CapFloat(P.Set("0123456789.e-+infa")**0)
+        self.assertEqual(p("2.5e3").captures, [2500.0])
+        self.assertEqual(p("inf").captures, [float("inf")])
+
+    def testdecode(self):
+        p = P.CapDecode(P(1)**0, "utf-8")
+        self.assertEqual(p("caf\xc3\xa9").captures, [u"caf\xe9"])
+
+    def testnested(self):
+        # Nested captures are skipped; only the matched text is converted
+        p = P.CapInt(P.Cap(P.Range("09")) + P.Range("09")**0)
+        self.assertEqual(p("42").captures, [42])
+
+    def testerrors(self):
+        self.assertRaises(ValueError, P.CapInt(P(1)**0), "12x")
+        for subject in (" 1", "1 ", " 1 "):
+            self.assertRaises(ValueError, P.CapInt(P.Set(" 1")**0), subject)
+        self.assertRaises(ValueError, P.CapFloat(P(1)**0), "1.5x")
+        self.assertRaises(ValueError, P.CapFloat(P(1)**0), "")
+        self.assertRaises(ValueError, P.CapInt(P(1)**0), "1\x002")
+        self.assertRaises(UnicodeDecodeError,
+                          P.CapDecode(P(1)**0, "utf-8"), "\xff")
+        self.assertRaises(ValueError, P.CapInt, P(1), 1)
+
+
+class TestCallbackArgs(TestCase):
+    def testbuiltin(self):
+        p = P.Cap(P(1)**0) / len
+        self.assertEqual(p("abc").captures, [3])
+        p = P.CapC(1, 2) / max
+        self.assertEqual(p("").captures, [2])
+
+    def testfoldkeepsargs(self):
+        # Argument tuples kept by the function must not be reused
+        seen = []
+        def fn(*args):
+            seen.append(args)
+            return args[0] + args[1]
+        p = P.CapF(P.Cap(P(1))**1, fn)
+        self.assertEqual(p("abcd").captures, ["abcd"])
+        self.assertEqual(seen, [("a", "b"), ("ab", "c"), ("abc", "d")])
+
+    def testfoldreuse(self):
+        p = P.CapF(P.Cap(P(1))**1, lambda a, b: b + a)
+        self.assertEqual(p("abcd").captures, ["dcba"])
+
+
+class TestCallbackArity(TestCase):
+    def testtrimmed(self):
+        # Values the function cannot take are dropped without being built
+        built = []
+        def value(s):
+            built.append(s)
+            return s
+        inner = P.Cap(P(1)) / value
+        p = (inner + inner + inner) / (lambda a: a)
+        self.assertEqual(p("abc").captures, ["a"])
+        self.assertEqual(built, ["a"])
+
+    def testnone(self):
+        p = P.Cap(P(1)**0) / (lambda: "x")
+        self.assertEqual(p("abc").captures, ["x"])
+
+    def testwholematch(self):
+        p = P(1)**0 / (lambda s, extra=None: (s, extra))
+        self.assertEqual(p("abc").captures, [("abc", None)])
+
+    def testvarargs(self):
+        p = (P.Cap(P(1))**0) / (lambda *args: args)
+        self.assertEqual(p("abc").captures, [("a", "b", "c")])
+
+    def testmethod(self):
+        class Lookup(object):
+            def get(self, key):
+                return key.upper()
+        p = (P.Cap(P(1)) + P.Cap(P(1))) / Lookup().get
+        self.assertEqual(p("ab").captures, ["A"])
+
+
+class TestNativeFunc(TestCase):
+    # Native functions are written in C; ctypes stands in for one here
+    PattFunc = ctypes.CFUNCTYPE(ctypes.c_void_p, ctypes.c_void_p,
+                                ctypes.c_void_p, ctypes.c_void_p,
+                                ctypes.c_void_p)
+
+    class PattFuncDef(ctypes.Structure):
+        _fields_ = [("f", ctypes.c_void_p), ("ud", ctypes.c_void_p),
+                    ("udlen", ctypes.c_size_t)]
+
+    name = "_ppeg.PattFunc"
+
+    def setUp(self):
+        # The C function must outlive the patterns using it
+        self.keep = []
+
+    def capsule(self, fn, ud="", name=None):
+        f = self.PattFunc(fn)
+        buf = ctypes.create_string_buffer(ud, len(ud))
+        fdef = self.PattFuncDef(ctypes.cast(f, ctypes.c_void_p),
+                                ctypes.cast(buf, ctypes.c_void_p), len(ud))
+        self.keep.append((f, buf, fdef))
+        new = ctypes.pythonapi.PyCapsule_New
+        new.restype = ctypes.py_object
+        new.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
+        return new(ctypes.addressof(fdef), name or self.name, None)
+
+    def testspan(self):
+        # Span over the characters given as user data
+        def span(ud, o, s, e):
+            chars = ctypes.string_at(ud, 2)
+            text = ctypes.string_at(s, e - s)
+            return s + len(text) - len(text.lstrip(chars))
+        p = P(self.capsule(span, "ab")) + "c"
+        self.assertEqual(p("abbac").pos, 5)
+        self.assertEqual(p("cab").pos, 1)
+        self.assertEqual([i[0] for i in p.dump()], ["func", "char", "end"])
+
+    def testfail(self):
+        p = P.Cap(P(1)) + P(self.capsule(lambda ud, o, s, e: None))
+        self.assertEqual(p("ab").pos, -1)
+        p = P(self.capsule(lambda ud, o, s, e: e)) | "x"
+        self.assertEqual(p("abc").pos, 3)
+
+    def testposition(self):
+        p = P(self.capsule(lambda ud, o, s, e: e + 1))
+        self.assertRaises(RuntimeError, p, "abc")
+
+    def testname(self):
+        c = self.capsule(lambda ud, o, s, e: s, name="other")
+        self.assertRaises(ValueError, P, c)
+
+
+class TestDeferred(TestCase):
+    def testlongchains(self):
+        seq = P("")
+        alt = P.Fail()
+        for i in range(2000):
+            seq = seq + "ab"
+            alt = alt | "k%d;" % i
+        self.assertEqual(seq.test("ab" * 2000), 4000)
+        self.assertEqual(alt.test("k1234;"), 6)
+        self.assertEqual(alt.test("k2000;"), -1)
+
+    def testdeep(self):
+        # Dropping an uncompiled chain must not recurse once per operator
+        p = P("a")
+        for i in range(200000):
+            p = p + "a"
+        del p
+
+    def testcompile(self):
+        p = P("a") + P(1) + P(2) | "b"
+        self.assertTrue(p.compile() is p)
+        self.assertEqual([i[0] for i in p.dump()],
+                         ["char", "any", "jmp", "char", "end"])
+
+    def testsamecode(self):
+        # Chains compile to the same code as combining each step eagerly
+        pa, pb = P("a"), P("b")
+        p = P.Set("ab")
+        q = P.Set("ab")
+        for r in (pa, P.Cap(pb), P(1), pa + pb):
+            p = p | r
+            q = (q | r).compile()
+        self.assertEqual(p.dump(), q.dump())
+        self.assertEqual(p.env(), q.env())
+
+    def testnested(self):
+        # A choice on the right is compiled on its own, as | would have
+        def eager(a, b):
+            return (a.compile() | b.compile()).compile()
+        cases = [
+            ((P(-2) | P.Set("c")), (P("") | P("cac"))),
+            (P.Cap(P("a")), (P("-") | P("a"))),
+            ((P("b") | P.Cap(P("b"))), (P(1) | P("-")) | (P("c") | P(2))),
+            ((P("a") | P("")), P("b")),
+        ]
+        for a, b in cases:
+            self.assertEqual((a | b).dump(), eager(a, b).dump())
+        self.assertEqual(len(((P(-2) | P.Set("c")) | (P("") | P("cac"))).dump()), 7)
+
+    def testshared(self):
+        # Operands used in several patterns are left unchanged
+        a = P("a") + "b"
+        p = a | a + "c"
+        self.assertEqual(p("abc").pos, 2)
+        self.assertEqual(a("abc").pos, 2)
+        self.assertEqual((a + a)("abab").pos, 4)
+
+
+class TestHash(TestCase):
+    def testequal(self):
+        p1 = (P("ab") | P.Set("xy")) + P.Cap(P(1)**0)
+        p2 = (P("ab") | P.Set("xy")) + P.Cap(P(1)**0)
+        self.assertEqual(p1, p2)
+        self.assertEqual(hash(p1), hash(p2))
+        self.assertNotEqual(p1, P("ab"))
+        self.assertEqual({p1: 1}[p2], 1)
+
+    def testenv(self):
+        f = lambda s: s
+        self.assertEqual(P(1) / f, P(1) / f)
+        self.assertNotEqual(P(1) / f, P(1) / (lambda s: s))
+        self.assertEqual(P.CapC("a"), P.CapC("a"))
+        self.assertNotEqual(P.CapC("a"), P.CapC("b"))
+
+    def testnotpattern(self):
+        self.assertFalse(P("a") == "a")
+        self.assertTrue(P("a") != 1)
+
+    def testintern(self):
+        p1 = (P("a") + P("b")).intern()
+        p2 = (P("a") + P("b")).intern()
+        self.assertTrue(p1 is p2)
+        self.assertTrue(P("ab").intern() is P("ab").intern())
+
+    def testenvhash(self):
+        hashes = set(hash(P.CapC(i)) for i in range(1000))
+        self.assertTrue(len(hashes) > 900)
+        # Unhashable values are compared, but hash by type
+        self.assertEqual(hash(P.CapC([1])), hash(P.CapC([2])))
+        self.assertEqual({P.CapC([1]): 1}[P.CapC([1])], 1)
+
+    def testinternpurge(self):
+        import weakref
+        class Value(object):
+            pass
+        kept = P.CapC("kept").intern()
+        value = Value()
+        P.CapC(value).intern()
+        ref = weakref.ref(value)
+        del value
+        for i in range(1000):
+            P.CapC(i).intern()
+        self.assertTrue(ref() is None)
+        self.assertTrue(P.CapC("kept").intern() is kept)
+
+
+class TestPeCache(TestCase):
+    def setUp(self):
+        import pe
+        self.pe = pe
+        pe.purge()
+
+    def testcache(self):
+        pe = self.pe
+        p = pe.compile('"a" [bc]*')
+        self.assertTrue(pe.compile('"a" [bc]*') is p)
+        self.assertEqual(pe.cache_info()[:2], (1, 1))
+        self.assertEqual(p("abcb").pos, 4)
+
+    def testdefs(self):
+        pe = self.pe
+        d1 = {'up': lambda s: s.upper()}
+        d2 = {'up': lambda s: s}
+        p1 = pe.compile('{[a-z]+} -> up', d1)
+        p2 = pe.compile('{[a-z]+} -> up', d2)
+        self.assertFalse(p1 is p2)
+        self.assertEqual(p1("ab").captures, ["AB"])
+        self.assertEqual(p2("ab").captures, ["ab"])
+        self.assertTrue(pe.compile('{[a-z]+} -> up', d1) is p1)
+
+    def testlimit(self):
+        pe = self.pe
+        old = pe.MAXCACHE
+        pe.MAXCACHE = 2
+        try:
+            for src in ('"a"', '"b"', '"a"', '"c"', '"a"'):
+                pe.compile(src)
+            self.assertEqual(pe.cache_info(), (2, 3, 2, 2))
+        finally:
+            pe.MAXCACHE = old
+        pe.purge()
+        self.assertEqual(pe.cache_info(), (0, 0, old, 0))
+
+
+class TestPeSyntax(TestCase):
+    def setUp(self):
+        import pe
+        self.pe = pe
+
+    def testrepeat(self):
+        compile = self.pe.compile
+        self.assertEqual(compile('"a"^+2')("aaa").pos, 3)
+        self.assertEqual(compile('"a"^+2')("a").pos, -1)
+        self.assertEqual(compile('"a"^-2')("aaa").pos, 2)
+
+    def testtable(self):
+        self.assertEqual(self.pe.compile('"a" -> {}')("a").captures, [[]])
+
+    def testerrors(self):
+        for expr in ('("a"', '%foo', 'x <- "a" x <- "b"'):
+            self.assertRaises(ValueError, self.pe.compile, expr)
+
+
+class TestRe(TestCase):
+    exprs = [
+        '', '"a"^3', '"a"^+2', '"a"^-2', '[^a-c]', '[]a]', '[a-]', '%nl',
+        '{~ "a" -> "b" ~}', '"a" -> {}', '"x" => f', '{:x: [a-z] :} =x',
+        '&"a" !"b" .', '"a" / "b" "c" -- comment', '{"a"} -> up', '{}',
+        'a <- "x" <b>  b <- "y"', '(a <- "x" <a>?)', '{:"a" :}+',
+    ]
+    defs = {'f': lambda s, i, *a: i, 'up': lambda s: s.upper()}
+    primaries = ['"a"', "'b'", '"cac"', '[^a-c]', '[]a-]', '%nl', '.',
+                 '<t>', '[abcdefghijklmnopq]']
+    # Primaries which may match the empty string, and so are not repeated
+    empties = ['""', '{}', '=x']
+    suffixes = ['', '', '', ' -> up', ' -> "x"', ' -> {}', ' => f']
+    loops = ['+', '*', '?', '^2', '^+1', '^-2']
+    errors = [' ]', ' )', ' -> g', ' %foo', '(', ' x <- "a"', ' [', '^', '{:']
+
+    def setUp(self):
+        import pe
+        self.pe = pe
+
+    def expression(self, r, depth):
+        seqs = []
+        for i in range(r.randint(1, 3)):
+            items = []
+            for j in range(r.randint(1, 3)):
+                suffix = r.choice(self.suffixes)
+                if depth > 0 and r.random() < 0.3:
+                    item = r.choice(['(%s)', '{%s}', '{:%s:}', '{:x: %s :}',
+                                     '{~%s~}']) % self.expression(r, depth - 1)
+                elif r.random() < 0.2:
+                    item = r.choice(self.empties)
+                else:
+                    item = r.choice(self.primaries)
+                    suffix = r.choice(self.loops + [suffix])
+                items.append(r.choice(['', '', '&', '!']) + item + suffix)
+            seqs.append(" ".join(items))
+        return " / ".join(seqs)
+
+    def compiled(self, fn, *args):
+        # The code, or the kind of error
+        try:
+            return fn(*args).dump()
+        except Exception, e:
+            return type(e), str(e).startswith("pattern error")
+
+    def testreference(self):
+        for expr in self.exprs:
+            self.assertEqual(P.Re(expr, self.defs, self.pe.predef).dump(),
+                             self.pe.compile_py(expr, self.defs).dump())
+
+    def testmatch(self):
+        p = P.Re('{:x: [a-z]+ :} "-" =x')
+        self.assertEqual(p("ab-ab").pos, 5)
+        self.assertEqual(p("ab-ac").pos, -1)
+        p = P.Re('{[a-z]+} -> up', self.defs)
+        self.assertEqual(p("abc").captures, ["ABC"])
+
+    def testerrors(self):
+        for expr in ('("a"', '"a" )', '[a', '%foo', 'x <- "a" x <- "b"',
+                     '"a" -> up'):
+            self.assertRaises(ValueError, P.Re, expr)
+        self.assertRaises(KeyError, P.Re, '"a" -> g', self.defs)
+        self.assertRaises(RuntimeError, P.Re, 's <- <r>')
+        # Syntax errors are reported before undefined names
+        self.assertRaises(ValueError, P.Re, '"a" -> c ]x', self.defs)
+        self.assertRaises(ValueError, P.Re, 'x <- "a" x <- "b" )')
+
+    def testcorpus(self):
+        # Random expressions, and the same with a stray token inserted.
+        # Syntax errors may be reported at another position than the
+        # reference gives.
+        r = random.Random(1)
+        for i in range(300):
+            expr = 's <- %s  t <- "t" (%s)' % (self.expression(r, 2),
+                                             self.expression(r, 1))
+            if r.random() < 0.5:
+                k = r.randint(0, len(expr))
+                expr = expr[:k] + r.choice(self.errors) + expr[k:]
+            self.assertEqual(
+                self.compiled(P.Re, expr, self.defs, self.pe.predef),
+                self.compiled(self.pe.compile_py, expr, self.defs), expr)
+
+
+class TestDispatch(TestCase):
+    words = ["if", "else", "while", "for", "return", "break", "int", "char"]
+
+    def choice(self, alts):
+        p = P.Fail()
+        for a in alts:
+            p = p | a
+        return p
+
+    def testdispatch(self):
+        p = self.choice(self.words)
+        self.assertEqual(p.dump()[0][0], "dispatch")
+        for w in self.words:
+            self.assertEqual(p(w + "x").pos, len(w))
+        for s in ("", "x", "i", "els", "whil"):
+            self.assertEqual(p(s).pos, -1)
+
+    def testordered(self):
+        # The first alternative accepting the subject wins, as without
+        # the dispatch
+        p = self.choice(["ab", "a", P.Set("ab") + "c", "b", "ca", "c"])
+        self.assertEqual([p(s).pos for s in ("abc", "ac", "bc", "b", "ca",
+                                             "cb", "d")],
+                         [2, 1, 2, 1, 2, 1, -1])
+
+    def testdefault(self):
+        p = self.choice(self.words + [P(1)])
+        self.assertEqual(p("int").pos, 3)
+        self.assertEqual(p("in").pos, 1)
+        self.assertEqual(p("z").pos, 1)
+        self.assertEqual(p("").pos, -1)
+
+    def testnested(self):
+        p = self.choice(self.words)
+        q = (p + ";") | "{" | "}" | (p + "(") | P.Set("xyz")
+        self.assertEqual([q(s).pos for s in ("for;", "for(", "{", "y", "for")],
+                         [4, 4, 1, 1, -1])
+        g = P.Grammar(self.choice(["a" + P.Var("x"), "b" + P.Var("x") + P.Var("x"),
+                                   "c", "d" + P.Var("x")]), x=P("yy"))
+        self.assertEqual([g(s).pos for s in ("ayy", "byyyy", "byy", "c",
+                                             "dyy", "e")],
+                         [3, 5, -1, 1, 3, -1])
+
+
+class TestTrie(TestCase):
+    words = ["select", "insert", "update", "delete", "from", "where", "in",
+             "into", "set", "sel", "selection", "values", "order", "by",
+             "group", "having", "limit", "in", "s", "join"]
+
+    def choice(self, alts):
+        p = P.Fail()
+        for a in alts:
+            p = p | a
+        return p
+
+    def testtrie(self):
+        p = self.choice(self.words)
+        self.assertEqual([i[0] for i in p.dump()], ["trie", "end"])
+        # The first literal which matches wins, not the longest
+        self.assertEqual([p(s).pos for s in ("selection", "sel", "se",
+                                             "into", "in", "i", "", "x")],
+                         [6, 3, 1, 2, 2, -1, -1, -1])
+        p = self.choice(["selection", "into"] + self.words)
+        self.assertEqual([p(s).pos for s in ("selection", "into")], [9, 4])
+
+    def testmixed(self):
+        p = self.choice([P.Cap("x")] + self.words + [P.Cap(P(1))])
+        self.assertEqual([i[0] for i in p.dump()].count("trie"), 1)
+        self.assertEqual(p("x").captures, ["x"])
+        self.assertEqual(p("where").captures, [])
+        self.assertEqual(p("wh").captures, ["w"])
+        self.assertEqual(p("").pos, -1)
+
+    def testchars(self):
+        # Single characters are still merged into a set
+        p = self.choice("abcdefghijklmnopqrstuvwxyz")
+        self.assertEqual([i[0] for i in p.dump()], ["set", "end"])
+
+    def testmany(self):
+        words = ["k%d;" % i for i in range(3000)]
+        p = self.choice(words)
+        for w in ("k0;", "k9;", "k10;", "k999;", "k2999;"):
+            self.assertEqual(p(w).pos, len(w))
+        self.assertEqual(p("k3000;").pos, -1)
+
+
+class TestSearch(TestCase):
+    iocs = ["evil.example", "10.0.0.66", "deadbeef", "cafe", "c2-server",
+            "bcd", "abcde", "dropper.exe", "beacon", "mimikatz", "psexec",
+            "0xfeed", "badcafe", "ab", "rundll32", "certutil"]
+
+    def choice(self, alts):
+        p = P.Fail()
+        for a in alts:
+            p = p | a
+        return p
+
+    def search(self, p, s):
+        m = p.search(s)
+        return (m.start, m.pos) if m else None
+
+    def brute(self, p, s):
+        for i in range(len(s) + 1):
+            m = p(s[i:])
+            if m.pos >= 0:
+                return (i, i + m.pos)
+        return None
+
+    def testsearch(self):
+        self.assertEqual(self.search(P("abc"), "xxabcx"), (2, 5))
+        self.assertEqual(self.search(P("abc"), "xxabx"), None)
+        self.assertEqual(self.search(P(0), "xx"), (0, 0))
+        self.assertEqual(self.search(P(1) + P(-1), "xyz"), (2, 3))
+        self.assertEqual(P("b")("abc").start, 0)
+
+    def testtrie(self):
+        p = self.choice(self.iocs)
+        self.assertEqual(p.dump()[0][0], "trie")
+        for s in ("a cafe near 10.0.0.66", "xabcdex", "xbcdx", "zzab",
+                  "nothing here", "", "caf", "badcafe", "deadbeefcafe"):
+            self.assertEqual(self.search(p, s), self.brute(p, s))
+        # The leftmost match wins, even if another string ends first
+        self.assertEqual(self.search(p, "xabcdex"), (1, 6))
+        self.assertEqual(self.search(p, "xbcdeab"), (1, 4))
+
+    def testcaptures(self):
+        p = P.CapP() + P.Cap(self.choice(self.iocs)) + P.CapP()
+        m = p.search("log: beacon sent")
+        self.assertEqual(m.captures, [5, "beacon", 11])
+        m = p.search("log: beacon", spans=True)
+        self.assertEqual(m.captures, [5, (5, 11), 11])
+
+    def testpos(self):
+        p = self.choice(self.iocs)
+        m = p.search("cafe cafe", pos=1)
+        self.assertEqual((m.start, m.pos), (5, 9))
+        self.assertEqual(p.search("cafe", pos=4).pos, -1)
+        self.assertRaises(ValueError, p.search, "cafe", pos=5)
+        self.assertRaises(ValueError, p.search, "cafe", pos=-1)
+        self.assertRaises(TypeError, p.search, "cafe", start=1)
+
+    def testother(self):
+        for p in (P.Set("xy") + "z", P.Grammar(P("a") + P.Var("b"), b=P("b")),
+                  -P("q") + P(1), self.choice(self.iocs) | P.Set("z")):
+            for s in ("", "xyz", "qab", "zz", "qqq"):
+                self.assertEqual(self.search(p, s), self.brute(p, s))
+
+    def testfirstbytes(self):
+        # Short choices start with a dispatch or a test rather than a
+        # string, and are searched for the bytes their alternatives start with
+        words = self.choice(["if", "else", "while", "for", "return"])
+        tests = P.Cap(P("ab")) | P("cd")
+        self.assertEqual(words.dump()[0][0], "dispatch")
+        self.assertEqual(tests.dump()[0][:3], ("char", 97, 4))
+        for p in (words, tests, tests | P(-1), P.Cap(P("ab")) | P(0),
+                  P("ab")**0 + "c"):
+            for s in ("", "xxreturn", "zzcd", "eels", "fofor", "abab", "c"):
+                self.assertEqual(self.search(p, s), self.brute(p, s))
+
+
 if __name__ == '__main__':
     main()